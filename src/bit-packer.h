@@ -3,6 +3,8 @@
 #ifndef BIT_PACKER_H
 #define BIT_PACKER_H
 
+#include <cstring>
+
 #include "util.h"
 
 // A class for serializing/deserializing a stream of variable
@@ -26,6 +28,23 @@
 //   Packer::Context unpack;
 //   data.extract(a, 6, &unpack);
 //   data.extract(b, 7, &unpack);
+//
+// If the bit offsets of the fields are known at compile time, they
+// can instead be serialized with a Words object. Each field is then
+// just a shift and a mask of a 64-bit word, with no state carried
+// from one field to the next. The bytes are stored most significant
+// first (unlike with deposit()), so comparing two Packers with memcmp
+// compares the fields at the highest offsets first:
+//
+//   Packer<63>::Words words;
+//   words.put(a, 0, 6);
+//   words.put(b, 6, 7);
+//   data.store(words);
+//
+//   Packer<63>::Words words;
+//   data.load(&words);
+//   words.get(a, 0, 6);
+//   words.get(b, 6, 7);
 template<size_t Bits>
 struct Packer {
     // Size of the serialized data.
@@ -86,6 +105,81 @@ struct Packer {
         context->at_ = at;
     }
 
+    // The serialized data as 64-bit words, for storing fields at
+    // fixed bit offsets. Bit N of the data is bit N % 64 of word
+    // N / 64.
+    struct Words {
+        static const int kWords = (Bits + 63) / 64;
+
+        // Stores the lowest _width_ bits of _data_ at bits _offset_
+        // to _offset_ + _width_ - 1, which must not have been set
+        // yet.
+        template<typename T>
+        void put(T data, int offset, int width) {
+            assert(width < 64 && offset + width <= Bits);
+            uint64_t value = (uint64_t) data & mask_n_bits(width);
+            int word = offset / 64;
+            int shift = offset % 64;
+            words_[word] |= value << shift;
+            if (shift + width > 64) {
+                words_[word + 1] |= value >> (64 - shift);
+            }
+        }
+
+        // Reads the _width_ bits starting at bit _offset_, and stores
+        // them in _data_.
+        template<typename T>
+        void get(T& data, int offset, int width) const {
+            assert(width < 64 && offset + width <= Bits);
+            int word = offset / 64;
+            int shift = offset % 64;
+            uint64_t value = words_[word] >> shift;
+            if (shift + width > 64) {
+                value |= words_[word + 1] << (64 - shift);
+            }
+            data = value & mask_n_bits(width);
+        }
+
+        uint64_t words_[kWords] = { 0 };
+    };
+
+    // Sets the serialized data from words, as a big-endian integer
+    // of Bytes bytes.
+    void store(const Words& words) {
+        for (int i = 0; i < Words::kWords; ++i) {
+            int bytes = word_bytes(i);
+            uint64_t word = __builtin_bswap64(words.words_[i] <<
+                                              (8 * (8 - bytes)));
+            memcpy(bytes_ + Bytes - 8 * i - bytes, &word, bytes);
+        }
+    }
+
+    // Copies the serialized data to *words.
+    void load(Words* words) const {
+        for (int i = 0; i < Words::kWords; ++i) {
+            int bytes = word_bytes(i);
+            const uint8_t* at = bytes_ + Bytes - 8 * i - bytes;
+            uint64_t word = 0;
+            if (bytes == 8) {
+                memcpy(&word, at, 8);
+            } else if (bytes >= 4) {
+                // A partial word is assembled in a register, from two
+                // possibly overlapping 32-bit loads. Copying its bytes
+                // into a word in memory would make the first read of
+                // the word wait for the narrower stores to complete.
+                uint32_t low, high;
+                memcpy(&low, at, 4);
+                memcpy(&high, at + bytes - 4, 4);
+                word = low | (uint64_t) high << (8 * (bytes - 4));
+            } else {
+                for (int j = bytes - 1; j >= 0; --j) {
+                    word = word << 8 | at[j];
+                }
+            }
+            words->words_[i] = __builtin_bswap64(word) >> (8 * (8 - bytes));
+        }
+    }
+
     // Reads the next _width_ bits from the backing array, and
     // stores them in _data_.
     template<typename T>
@@ -99,6 +193,11 @@ struct Packer {
     }
 
 private:
+    // The number of bytes of the serialized data in word i of Words.
+    static constexpr int word_bytes(int i) {
+        return Bytes - 8 * i < 8 ? Bytes - 8 * i : 8;
+    }
+
     // Fill acc_ from bytes_. (Only reads full bytes; this makes 56
     // bits the maximum field size that's guaranteed to work.).
     void refill(Context* context) const {
@@ -0,0 +1,93 @@
+// -*- mode: c++ -*-
+
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "util.h"
+
+// A blocked Bloom filter over 64-bit hash values. Each value maps
+// to a single 512 bit block (i.e. one cache line), and sets kHashes
+// bits within that block. This has a somewhat higher false positive
+// rate than a standard Bloom filter of the same size, but needs
+// just one cache miss per insert or lookup.
+//
+// insert() and maybe_contains() can be called concurrently from
+// multiple threads.
+class BlockedBloomFilter {
+public:
+    // Creates a filter using (approximately) the given number of
+    // bytes of memory.
+    explicit BlockedBloomFilter(size_t bytes)
+        : block_count_(std::max(bytes / kBlockBytes, size_t(1))),
+          storage_(new std::atomic<uint64_t>[(block_count_ + 1) * kWords]) {
+        // Align the blocks to cache lines.
+        uintptr_t addr = reinterpret_cast<uintptr_t>(storage_.get());
+        words_ = storage_.get() + (-addr % kBlockBytes) / sizeof(uint64_t);
+        for (size_t i = 0; i < block_count_ * kWords; ++i) {
+            words_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void insert(uint64_t hash) {
+        std::atomic<uint64_t>* block = block_words(hash);
+        uint64_t bits = bit_seed(hash);
+        for (int i = 0; i < kHashes; ++i, bits >>= kBitIndexWidth) {
+            int bit = bits & mask_n_bits(kBitIndexWidth);
+            block[bit / 64].fetch_or(UINT64_C(1) << (bit % 64),
+                                           std::memory_order_relaxed);
+        }
+    }
+
+    // Returns false if the value has definitely not been inserted
+    // into the filter, true if it might have been.
+    bool maybe_contains(uint64_t hash) const {
+        const std::atomic<uint64_t>* block = block_words(hash);
+        uint64_t bits = bit_seed(hash);
+        for (int i = 0; i < kHashes; ++i, bits >>= kBitIndexWidth) {
+            int bit = bits & mask_n_bits(kBitIndexWidth);
+            uint64_t word = block[bit / 64].load(
+                std::memory_order_relaxed);
+            if (!(word & (UINT64_C(1) << (bit % 64)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t size_bytes() const {
+        return block_count_ * kBlockBytes;
+    }
+
+private:
+    static const int kWords = 8;
+    static const int kBitIndexWidth = 9;
+    static const int kHashes = 6;
+
+    static const size_t kBlockBytes = kWords * sizeof(uint64_t);
+
+    // Maps the high 32 bits of the hash to a block, without a
+    // division.
+    std::atomic<uint64_t>* block_words(uint64_t hash) const {
+        return words_ + (((hash >> 32) * block_count_) >> 32) * kWords;
+    }
+
+    // Derives the bit indexes within the block from the hash. The
+    // multiplication mixes all the bits of the hash into the top
+    // bits, which are then used kBitIndexWidth bits at a time.
+    static uint64_t bit_seed(uint64_t hash) {
+        return (hash * UINT64_C(0x9e3779b97f4a7c15)) >>
+            (64 - kHashes * kBitIndexWidth);
+    }
+
+    size_t block_count_;
+    std::unique_ptr<std::atomic<uint64_t>[]> storage_;
+    // The first word of the first block, within storage_.
+    std::atomic<uint64_t>* words_;
+};
+
+#endif // BLOOM_FILTER_H
@@ -0,0 +1,167 @@
+// -*- mode: c++ -*-
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <third-party/cityhash/city.h>
+
+// The manifest of a checkpoint: a small text file of records, each
+// consisting of a name and a list of integers. The manifest is
+// what makes a checkpoint valid, so it's written atomically (via
+// a rename), and verified with a checksum when read.
+class CheckpointManifest {
+public:
+    struct Record {
+        std::string name;
+        std::vector<uint64_t> values;
+    };
+
+    void add(const std::string& name, const std::vector<uint64_t>& values) {
+        records_.push_back(Record { name, values });
+    }
+
+    // Returns the first record with the given name, or NULL if
+    // there isn't one.
+    const Record* find(const std::string& name) const {
+        for (const auto& record : records_) {
+            if (record.name == name) {
+                return &record;
+            }
+        }
+        return NULL;
+    }
+
+    const std::vector<Record>& records() const {
+        return records_;
+    }
+
+    // Atomically replaces the manifest file at path with the contents
+    // of this manifest.
+    void write(const std::string& path) const {
+        std::string text = format();
+        char checksum[64];
+        snprintf(checksum, sizeof(checksum), "checksum %" PRIu64 "\n",
+                 CityHash64(text.data(), text.size()));
+        text += checksum;
+
+        std::string tmp_path = path + ".tmp";
+        FILE* file = fopen(tmp_path.c_str(), "w");
+        if (!file) {
+            perror(tmp_path.c_str());
+            abort();
+        }
+        if (fwrite(text.data(), 1, text.size(), file) != text.size() ||
+            fflush(file) != 0 ||
+            fsync(fileno(file)) != 0) {
+            perror(tmp_path.c_str());
+            abort();
+        }
+        fclose(file);
+        if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+            perror(path.c_str());
+            abort();
+        }
+        sync_directory(path);
+    }
+
+    // Reads the manifest from path. Returns false if the file does
+    // not exist, or has an invalid checksum.
+    bool read(const std::string& path) {
+        records_.clear();
+        FILE* file = fopen(path.c_str(), "r");
+        if (!file) {
+            return false;
+        }
+
+        std::string contents;
+        char buffer[4096];
+        for (size_t len; (len = fread(buffer, 1, sizeof(buffer), file)); ) {
+            contents.append(buffer, len);
+        }
+
+        bool valid = false;
+        for (size_t pos = 0; pos < contents.size(); ) {
+            size_t end = contents.find('\n', pos);
+            if (end == std::string::npos) {
+                end = contents.size();
+            }
+            std::string line = contents.substr(pos, end - pos);
+            pos = end + 1;
+
+            const char* it = line.c_str();
+            std::string name = next_token(&it);
+            if (name.empty()) {
+                continue;
+            }
+            std::vector<uint64_t> values;
+            for (std::string value; !(value = next_token(&it)).empty(); ) {
+                values.push_back(strtoull(value.c_str(), NULL, 10));
+            }
+            if (name == "checksum") {
+                std::string text = format();
+                valid = values.size() == 1 &&
+                    values[0] == CityHash64(text.data(), text.size());
+                break;
+            }
+            records_.push_back(Record { name, values });
+        }
+        fclose(file);
+
+        if (!valid) {
+            fprintf(stderr, "%s: invalid checkpoint manifest\n",
+                    path.c_str());
+            records_.clear();
+        }
+        return valid;
+    }
+
+private:
+    std::string format() const {
+        std::string text;
+        for (const auto& record : records_) {
+            text += record.name;
+            for (auto value : record.values) {
+                text += " " + std::to_string(value);
+            }
+            text += "\n";
+        }
+        return text;
+    }
+
+    // Splits the next whitespace-delimited token from *it.
+    static std::string next_token(const char** it) {
+        const char* start = *it + strspn(*it, " \t\n");
+        size_t len = strcspn(start, " \t\n");
+        *it = start + len;
+        return std::string(start, len);
+    }
+
+    // Makes sure that a rename of the file at path has reached the
+    // disk.
+    static void sync_directory(const std::string& path) {
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ?
+            "." : path.substr(0, slash + 1);
+        int fd = open(dir.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    std::vector<Record> records_;
+};
+
+#endif // CHECKPOINT_H
@@ -3,12 +3,26 @@
 #ifndef COMPRESS_H
 #define COMPRESS_H
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include <lz4.h>
+#include <zdict.h>
 #include <zstd.h>
 
+#include "delta-kernels.h"
+#include "elias-fano.h"
+#include "util.h"
+
 
 // An encoder / decoder for variable-width integers of at most _Width_
 // bits. Uses the classic stop-bit approach, where the 7 low bits have
@@ -21,70 +35,45 @@
 template<int Width>
 class VarInt {
 public:
+    static_assert(Width <= 64, "At most 64 bit integers are supported");
+
     static const uint64_t kTopBit = 1 << 7;
+    // The maximum number of bytes in an encoded integer.
+    static const int kMaxBytes = Width <= 8 ? 1 : 1 + (Width - 8 + 6) / 7;
 
     // Reads an integer from the octet pointer _it_. Advances the
     // pointer, returns the integer.
     static uint64_t decode(const uint8_t*& it) {
-        uint8_t byte = *it++;
-        if (Width <= 8) {
-            return byte;
-        }
-        if (Width <= 15) {
-            if (!(byte & kTopBit)) {
-                return byte;
-            }
-            return (byte & 0x7f) | (*it++ << 7);
-        }
-        if (Width <= 22) {
+        uint64_t value = 0;
+        for (int i = 0; i < kMaxBytes - 1; ++i) {
+            uint8_t byte = *it++;
+            value |= uint64_t(byte & ~kTopBit) << (7 * i);
             if (!(byte & kTopBit)) {
-                return byte;
+                return value;
             }
-            uint64_t val = byte & ~kTopBit;
-            byte = *it++;
-            if (!(byte & kTopBit)) {
-                return val | byte << 7;
-            } else {
-                val |= (byte & ~kTopBit) << 7;
-            }
-            byte = *it++;
-            val |= byte << 14;
-            return val;
         }
-        assert(false);
+        return value | uint64_t(*it++) << (7 * (kMaxBytes - 1));
     }
 
     // Encodes _value_. Calls _emit_ once for each output byte.
-    static void encode(uint64_t value, std::function<void(uint8_t)> emit) {
-        if (Width <= 8) {
-            emit(value);
-            return;
-        }
-        if (Width <= 15) {
+    template<class Emit>
+    static void encode(uint64_t value, Emit emit) {
+        for (int i = 0; i < kMaxBytes - 1; ++i) {
             if (value <= mask_n_bits(7)) {
                 emit(value);
                 return;
             }
             emit((value & mask_n_bits(7)) | kTopBit);
-            emit(value >> 7);
-            return;
-        }
-        if (Width <= 22) {
-            if (value <= mask_n_bits(7)) {
-                emit(value);
-                return;
-            }
-            if (value <= mask_n_bits(14)) {
-                emit((value & mask_n_bits(7)) | kTopBit);
-                emit((value >> 7) & mask_n_bits(7));
-                return;
-            }
-            emit((value & mask_n_bits(7)) | kTopBit);
-            emit(((value >> 7) & mask_n_bits(7)) | kTopBit);
-            emit(value >> 14);
-            return;
+            value >>= 7;
         }
-        assert(false);
+        emit(value);
+    }
+
+    // Encodes _value_ to _out_. Returns a pointer past the last
+    // byte written.
+    static uint8_t* encode(uint64_t value, uint8_t* out) {
+        encode(value, [&out] (uint8_t byte) { *out++ = byte; });
+        return out;
     }
 };
 
@@ -100,106 +89,838 @@ public:
 // record is the same as in the previous record in the stream. The
 // VarInt will have all bits set for the first record.
 //
-// The optional outer layer is normal zstd compression, with blocks
-// that correspond to roughly 32k of plaintext. Each block is
-// preceded by the compressed length of the block encoded as a VarInt.
+// Sorted streams can instead use the Elias-Fano format described in
+// elias-fano.h as the inner layer (see RunFormat).
+//
+// The outer layer splits the delta transformed data into blocks of
+// roughly CompressorOptions::block_size bytes, and compresses each
+// block with a block codec. A block is encoded as:
+//
+// <VarInt<22> length of the rest of the block> <tag octet>
+// <VarInt<22> length of the plaintext> <VarInt<32> number of records>
+// <octet N> <N octets: the first record> <codec payload>
+//
+// The low 4 bits of the tag identify the codec (see BlockCodec), and
+// the high 4 bits the inner layer format. So streams written with
+// different settings can be read by the same decompressor. Zstd
+// blocks can be compressed with a ZstdDictionary, in which case the
+// zstd frame header identifies the dictionary.
+//
+// The inner layer is reset at the start of each block (i.e. the
+// first record of a block is encoded as a delta against an all-zero
+// record). Every block can thus be decoded independently,
+// which allows for splitting a compressed byte range into parts at
+// block boundaries.
+//
+// The record count and the first record are the fence of the block.
+// They allow for indexing a sorted stream (see BlockIndex) without
+// decompressing any of the blocks.
+
+class ZstdDictionary;
+class ZstdSampler;
+
+// The codecs for compressing blocks. The values are stored in the
+// blocks, so they must not be changed.
+enum class BlockCodec : uint8_t {
+    // The block is stored as is.
+    kNone = 0,
+    kLz4 = 1,
+    kZstd = 2,
+    // Zstd with long distance matching.
+    kZstdLong = 3,
+};
+
+// The formats of the inner layer. The values are stored in the
+// blocks, so they must not be changed.
+enum class RunFormat : uint8_t {
+    // The radix delta transform. Works for any stream of records.
+    kRadixDelta = 0,
+    // Elias-Fano coding. Only works for sorted streams, but usually
+    // compresses those much better than the radix delta transform,
+    // even without a block codec.
+    kEliasFano = 1,
+};
+
+// Tuning knobs for the compression.
+struct CompressorOptions {
+    // The format of the inner layer.
+    RunFormat format = RunFormat::kRadixDelta;
+    // The codec for compressing new blocks.
+    BlockCodec codec = BlockCodec::kZstd;
+    // The zstd compression level. 0 means zstd's default level.
+    int level = 0;
+    // The amount of delta transformed data to collect into each
+    // block before compressing it. The compressed length of a block
+    // has to fit into a VarInt<22>, so this can be at most a few MB.
+    size_t block_size = 1 << 20;
+    // If not NULL, all zstd blocks are compressed using this
+    // dictionary.
+    const ZstdDictionary* dictionary = NULL;
+    // If not NULL, the uncompressed blocks are added to this sampler
+    // (for training a dictionary).
+    ZstdSampler* sampler = NULL;
+    // If not NULL, blocks are compressed and written out by the
+    // workers of this pool, while the compressor keeps collecting
+    // the next block.
+    ThreadPool* pool = NULL;
+};
+
+// Tuning knobs for reading compressed data.
+struct DecompressorOptions {
+    // If not NULL, the workers of this pool decompress the next
+    // read_ahead blocks of each stream before they're needed.
+    ThreadPool* pool = NULL;
+    // The number of blocks to decompress ahead of time. Each stream
+    // keeps at most read_ahead + 1 decompressed blocks in memory.
+    int read_ahead = 2;
+};
+
+// Counters for the work done by the outer layer, summed over all
+// threads.
+struct CompressionStats {
+    std::atomic<uint64_t> compress_ns { 0 };
+    std::atomic<uint64_t> compress_in_bytes { 0 };
+    std::atomic<uint64_t> compress_out_bytes { 0 };
+    std::atomic<uint64_t> decompress_ns { 0 };
+    std::atomic<uint64_t> decompress_in_bytes { 0 };
+    std::atomic<uint64_t> decompress_out_bytes { 0 };
+
+    void reset() {
+        compress_ns = 0;
+        compress_in_bytes = 0;
+        compress_out_bytes = 0;
+        decompress_ns = 0;
+        decompress_in_bytes = 0;
+        decompress_out_bytes = 0;
+    }
+
+    static CompressionStats& get() {
+        static CompressionStats stats;
+        return stats;
+    }
+
+    static uint64_t elapsed_ns(std::chrono::steady_clock::time_point start) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            elapsed).count();
+    }
+};
+
+// The zstd contexts of the current thread, and a scratch buffer for
+// compressed data. Creating a new context for every block would be
+// expensive, so each thread reuses one set for all the blocks it
+// compresses or decompresses.
+class ZstdContext {
+public:
+    static ZstdContext& get() {
+        thread_local ZstdContext context;
+        return context;
+    }
+
+    ZSTD_CCtx* cctx() { return cctx_; }
+    ZSTD_DCtx* dctx() { return dctx_; }
+
+    // Returns a buffer of at least _size_ bytes. The contents are
+    // only valid until the next call.
+    uint8_t* buffer(size_t size) {
+        if (buffer_.size() < size) {
+            buffer_.resize(size);
+        }
+        return &buffer_[0];
+    }
+
+    ~ZstdContext() {
+        ZSTD_freeCCtx(cctx_);
+        ZSTD_freeDCtx(dctx_);
+    }
+
+private:
+    ZstdContext()
+        : cctx_(ZSTD_createCCtx()),
+          dctx_(ZSTD_createDCtx()) {
+    }
+
+    ZSTD_CCtx* cctx_;
+    ZSTD_DCtx* dctx_;
+    std::vector<uint8_t> buffer_;
+};
+
+// Collects samples of uncompressed blocks for training a
+// ZstdDictionary. Can be used from multiple threads.
+class ZstdSampler {
+public:
+    // Collects at most max_bytes of samples.
+    explicit ZstdSampler(size_t max_bytes) : max_bytes_(max_bytes) {
+    }
+
+    // Adds samples taken from evenly spaced parts of the block,
+    // unless enough samples have already been collected.
+    void add(const uint8_t* block, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t count = std::min(size_t(kMaxSamplesPerBlock),
+                                std::max(size / kSampleSize, size_t(1)));
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t* sample = block + i * (size / count);
+            size_t sample_size = std::min(size_t(kSampleSize), size);
+            if (data_.size() + sample_size > max_bytes_) {
+                full_ = true;
+                return;
+            }
+            data_.insert(data_.end(), sample, sample + sample_size);
+            sizes_.push_back(sample_size);
+        }
+    }
+
+    // Returns true once no more samples fit in.
+    bool full() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return full_;
+    }
+
+private:
+    friend class ZstdDictionary;
+
+    static const size_t kSampleSize = 4 << 10;
+    static const size_t kMaxSamplesPerBlock = 8;
+
+    size_t max_bytes_;
+    mutable std::mutex mutex_;
+    std::vector<uint8_t> data_;
+    std::vector<size_t> sizes_;
+    bool full_ = false;
+};
+
+// A zstd dictionary, ready for use for both compression and
+// decompression.
+//
+// The compressed blocks don't point to the dictionary they were
+// compressed with, just contain its id. The decompressors look the
+// id up from a registry of all the dictionaries that currently exist.
+class ZstdDictionary {
+public:
+    // Creates a dictionary from the output of ZDICT, for compressing
+    // with the given zstd level.
+    ZstdDictionary(const std::vector<uint8_t>& data, int level)
+        : data_(data),
+          cdict_(ZSTD_createCDict(&data_[0], data_.size(), level)),
+          ddict_(ZSTD_createDDict(&data_[0], data_.size())),
+          id_(ZSTD_getDictID_fromDict(&data_[0], data_.size())) {
+        assert(cdict_ && ddict_ && id_);
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        registry().push_back(this);
+    }
+
+    ~ZstdDictionary() {
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            auto& dicts = registry();
+            dicts.erase(std::find(dicts.begin(), dicts.end(), this));
+        }
+        ZSTD_freeCDict(cdict_);
+        ZSTD_freeDDict(ddict_);
+    }
+
+    // Trains a dictionary of at most max_size bytes from the samples.
+    // Returns NULL if there weren't enough samples for training one.
+    static std::unique_ptr<ZstdDictionary> train(const ZstdSampler& sampler,
+                                                 size_t max_size,
+                                                 int level) {
+        std::lock_guard<std::mutex> lock(sampler.mutex_);
+        std::vector<uint8_t> data(max_size);
+        size_t size = ZDICT_trainFromBuffer(&data[0], data.size(),
+                                            &sampler.data_[0],
+                                            &sampler.sizes_[0],
+                                            sampler.sizes_.size());
+        if (ZDICT_isError(size)) {
+            return NULL;
+        }
+        data.resize(size);
+        return std::unique_ptr<ZstdDictionary>(new ZstdDictionary(data,
+                                                                  level));
+    }
+
+    // Returns the dictionary with the given id. The dictionary must
+    // exist.
+    static const ZSTD_DDict* find(unsigned id) {
+        std::lock_guard<std::mutex> lock(registry_mutex());
+        for (auto dict : registry()) {
+            if (dict->id_ == id) {
+                return dict->ddict_;
+            }
+        }
+        fprintf(stderr, "Unknown zstd dictionary %u\n", id);
+        abort();
+    }
+
+    const ZSTD_CDict* cdict() const { return cdict_; }
+    const std::vector<uint8_t>& data() const { return data_; }
+    unsigned id() const { return id_; }
+
+private:
+    ZstdDictionary(const ZstdDictionary& other) = delete;
+    ZstdDictionary& operator=(const ZstdDictionary& other) = delete;
+
+    static std::vector<ZstdDictionary*>& registry() {
+        static std::vector<ZstdDictionary*> dicts;
+        return dicts;
+    }
+
+    static std::mutex& registry_mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    std::vector<uint8_t> data_;
+    ZSTD_CDict* cdict_;
+    ZSTD_DDict* ddict_;
+    unsigned id_;
+};
+
+
+// The block codecs. A codec is a stateless class with the following
+// methods:
+//
+// - name(): The name of the codec, as accepted by parse_block_codec().
+// - bound(size): The maximum compressed size of _size_ bytes.
+// - compress(src, size, dst, capacity, options): Compresses the _size_
+//   bytes at src to dst, which has room for _capacity_ bytes. Returns
+//   the compressed size.
+// - decompress(src, len, dst, size): Decompresses the _len_ byte
+//   payload at src to the _size_ bytes of plaintext at dst.
+class NoCodec {
+public:
+    const char* name() const { return "none"; }
+
+    size_t bound(size_t size) const { return size; }
+
+    size_t compress(const uint8_t* src, size_t size,
+                    uint8_t* dst, size_t capacity,
+                    const CompressorOptions& options) const {
+        memcpy(dst, src, size);
+        return size;
+    }
+
+    void decompress(const uint8_t* src, size_t len,
+                    uint8_t* dst, size_t size) const {
+        assert(len == size);
+        memcpy(dst, src, size);
+    }
+};
+
+// LZ4 has no compression levels, but is several times faster than
+// zstd at both compression and decompression.
+class Lz4Codec {
+public:
+    const char* name() const { return "lz4"; }
+
+    size_t bound(size_t size) const { return LZ4_compressBound(size); }
+
+    size_t compress(const uint8_t* src, size_t size,
+                    uint8_t* dst, size_t capacity,
+                    const CompressorOptions& options) const {
+        int len = LZ4_compress_default((const char*) src, (char*) dst,
+                                       size, capacity);
+        assert(len > 0);
+        return len;
+    }
+
+    void decompress(const uint8_t* src, size_t len,
+                    uint8_t* dst, size_t size) const {
+        int ret = LZ4_decompress_safe((const char*) src, (char*) dst,
+                                      len, size);
+        assert(ret == (int) size);
+    }
+};
+
+class ZstdCodec {
+public:
+    const char* name() const { return "zstd"; }
+
+    size_t bound(size_t size) const { return ZSTD_compressBound(size); }
+
+    size_t compress(const uint8_t* src, size_t size,
+                    uint8_t* dst, size_t capacity,
+                    const CompressorOptions& options) const;
+
+    void decompress(const uint8_t* src, size_t len,
+                    uint8_t* dst, size_t size) const {
+        const ZSTD_DDict* ddict = NULL;
+        if (unsigned id = ZSTD_getDictID_fromFrame(src, len)) {
+            ddict = ZstdDictionary::find(id);
+        }
+        size_t ret = ZSTD_decompress_usingDDict(ZstdContext::get().dctx(),
+                                                dst, size, src, len, ddict);
+        assert(ret == size);
+    }
+};
+
+// Zstd with long distance matching. This finds matches further back
+// than the normal zstd match finder does, at some cost in compression
+// speed. Decompression works the same as for normal zstd.
+class ZstdLongCodec : public ZstdCodec {
+public:
+    const char* name() const { return "zstd-long"; }
+
+    size_t compress(const uint8_t* src, size_t size,
+                    uint8_t* dst, size_t capacity,
+                    const CompressorOptions& options) const;
+};
+
+// Calls fun with an instance of the codec class for _codec_, and
+// returns the result.
+template<class Fun>
+auto with_block_codec(BlockCodec codec, Fun fun) -> decltype(fun(NoCodec())) {
+    switch (codec) {
+    case BlockCodec::kNone:
+        return fun(NoCodec());
+    case BlockCodec::kLz4:
+        return fun(Lz4Codec());
+    case BlockCodec::kZstd:
+        return fun(ZstdCodec());
+    case BlockCodec::kZstdLong:
+        return fun(ZstdLongCodec());
+    }
+    fprintf(stderr, "Unknown block codec %d\n", (int) codec);
+    abort();
+}
+
+// Parses a codec specification of the form name[:level] (e.g. "lz4"
+// or "zstd:9") into options. Returns false if the specification is
+// not valid.
+inline bool parse_block_codec(const std::string& spec,
+                              CompressorOptions* options) {
+    size_t colon = spec.find(':');
+    std::string name = spec.substr(0, colon);
+    for (BlockCodec codec : { BlockCodec::kNone, BlockCodec::kLz4,
+                BlockCodec::kZstd, BlockCodec::kZstdLong }) {
+        if (name == with_block_codec(codec, [] (const auto& impl) {
+                    return impl.name();
+                })) {
+            options->codec = codec;
+            if (colon != std::string::npos) {
+                options->level = atoi(spec.c_str() + colon + 1);
+            }
+            return true;
+        }
+    }
+    return false;
+}
 
+// Parses the name of an inner layer format ("delta" or "elias-fano")
+// into options. Returns false if the name is not valid.
+inline bool parse_run_format(const std::string& name,
+                             CompressorOptions* options) {
+    if (name == "delta") {
+        options->format = RunFormat::kRadixDelta;
+    } else if (name == "elias-fano") {
+        options->format = RunFormat::kEliasFano;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// The inverse of parse_block_codec().
+inline std::string block_codec_spec(const CompressorOptions& options) {
+    std::string name = with_block_codec(options.codec,
+                                        [] (const auto& impl) {
+                                            return impl.name();
+                                        });
+    if (options.codec == BlockCodec::kZstd ||
+        options.codec == BlockCodec::kZstdLong) {
+        name += ":" + std::to_string(options.level);
+    }
+    return name;
+}
+
+inline size_t ZstdCodec::compress(const uint8_t* src, size_t size,
+                                  uint8_t* dst, size_t capacity,
+                                  const CompressorOptions& options) const {
+    ZSTD_CCtx* cctx = ZstdContext::get().cctx();
+    size_t len;
+    if (options.dictionary) {
+        len = ZSTD_compress_usingCDict(cctx, dst, capacity, src, size,
+                                       options.dictionary->cdict());
+    } else {
+        len = ZSTD_compressCCtx(cctx, dst, capacity, src, size,
+                                options.level);
+    }
+    assert(!ZSTD_isError(len));
+    return len;
+}
+
+inline size_t ZstdLongCodec::compress(const uint8_t* src, size_t size,
+                                      uint8_t* dst, size_t capacity,
+                                      const CompressorOptions& options) const {
+    ZSTD_CCtx* cctx = ZstdContext::get().cctx();
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, options.level);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+    if (options.dictionary) {
+        ZSTD_CCtx_refCDict(cctx, options.dictionary->cdict());
+    }
+    size_t len = ZSTD_compress2(cctx, dst, capacity, src, size);
+    assert(!ZSTD_isError(len));
+    // The parameters are sticky, so clear them for the other users
+    // of the context.
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    return len;
+}
+
+// A single block of the outer layer.
+struct CompressedBlock {
+    BlockCodec codec;
+    // The format of the plaintext.
+    RunFormat format;
+    // The number of records in the block, and the first of them.
+    size_t records;
+    const uint8_t* first;
+    size_t first_size;
+    // The codec payload.
+    const uint8_t* payload;
+    size_t payload_size;
+    // The size of the plaintext.
+    size_t size;
+    // The start of the next block.
+    const uint8_t* end;
+
+    // Parses the block starting at _it_.
+    static CompressedBlock parse(const uint8_t* it) {
+        CompressedBlock block;
+        uint64_t len = VarInt<22>::decode(it);
+        block.end = it + len;
+        uint8_t tag = *it++;
+        block.codec = static_cast<BlockCodec>(tag & 0xf);
+        block.format = static_cast<RunFormat>(tag >> 4);
+        block.size = VarInt<22>::decode(it);
+        block.records = VarInt<32>::decode(it);
+        block.first_size = *it++;
+        block.first = it;
+        it += block.first_size;
+        block.payload = it;
+        block.payload_size = block.end - it;
+        return block;
+    }
+
+    // Decompresses the plaintext to dst, which must have room for
+    // size bytes.
+    void decompress(uint8_t* dst) const {
+        with_block_codec(codec, [this, dst] (const auto& impl) {
+                impl.decompress(payload, payload_size, dst, size);
+            });
+    }
+};
 
 // Decompresses records of _Length_ bytes from an octet buffer
-// that's encoded in the format described above. If _Compress_
-// is false, only applies the radix delta transform.
-template<int Length, bool Compress=false>
+// that's encoded in the format described above. Order gives the
+// byte order of the records for the Elias-Fano format (see
+// elias-fano.h).
+template<int Length, class Order = MemcmpOrder<Length>>
 class ByteArrayDeltaDecompressor {
 public:
-    ByteArrayDeltaDecompressor(const uint8_t* begin, const uint8_t* end)
+    ByteArrayDeltaDecompressor(const uint8_t* begin, const uint8_t* end,
+                               const DecompressorOptions& options =
+                               DecompressorOptions())
         : raw_it_(begin),
-          raw_end_(end) {
-        if (Compress) {
-            refill();
-        } else {
-            it_ = begin;
-            end_ = end;
+          raw_end_(end),
+          options_(options) {
+        if (options_.read_ahead <= 0) {
+            options_.pool = NULL;
         }
+        refill();
+    }
+
+    ~ByteArrayDeltaDecompressor() {
+        // The workers may still be writing to the read-ahead blocks.
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] {
+                for (const auto& block : ahead_) {
+                    if (!block->ready) {
+                        return false;
+                    }
+                }
+                return true;
+            });
     }
 
     // Reads a record from the buffer, and stores it in _value_.
-    // Unless this is the first call to unpack(), _value_ should
-    // contain bytes that are equal to the previous record.
     //
     // Returns false if all the records have been read already.
     bool unpack(uint8_t value[Length]) {
-        if (it_ == end_ && !refill()) {
-            return false;
+        while (block_done()) {
+            if (!refill()) {
+                return false;
+            }
+            // The first record of a block is a delta against an
+            // all-zero record.
+            memset(record_, 0, sizeof(record_));
+        }
+        if (format_ == RunFormat::kEliasFano) {
+            elias_fano_.next(value);
+        } else {
+            unpack_internal(value);
         }
-        unpack_internal(value);
 
         return true;
     }
 
+    // Reads up to n records into the buffer at _out_, with each
+    // record starting _stride_ bytes after the previous one. The
+    // records of a block are decoded in a tight loop, rather than
+    // going through unpack() for each of them.
+    //
+    // Returns the number of records read, which is less than n only
+    // if all the records have been read.
+    size_t unpack_batch(uint8_t* out, size_t stride, size_t n) {
+        size_t count = 0;
+        while (count < n) {
+            while (block_done()) {
+                if (!refill()) {
+                    return count;
+                }
+                memset(record_, 0, sizeof(record_));
+            }
+            uint8_t* block_out = out + count * stride;
+            if (format_ == RunFormat::kEliasFano) {
+                count += unpack_elias_fano(block_out, stride, n - count);
+            } else {
+                count += unpack_deltas(block_out, stride, n - count);
+            }
+        }
+        return count;
+    }
+
 private:
     ByteArrayDeltaDecompressor(
         const ByteArrayDeltaDecompressor& other) = delete;
     ByteArrayDeltaDecompressor& operator=(
         const ByteArrayDeltaDecompressor& other) = delete;
 
-    // If the outer compression layer is in use, decompresses a block
-    // and points the radix transformer at the uncompressed data.
-    // We expect that records will never end up straddling two
-    // blocks.
+    using Kernels = RadixDeltaKernels<Length>;
+    using EliasFano = EliasFanoReader<Length, Order>;
+
+    // A block decompressed by a worker of options_.pool.
+    struct DecodedBlock {
+        CompressedBlock block;
+        std::vector<uint8_t> buffer;
+        // The plaintext of the block.
+        const uint8_t* data = NULL;
+        // Set by the worker once data is valid. Guarded by mutex_.
+        bool ready = false;
+    };
+
+    // Decompresses a block and points the radix transformer at the
+    // uncompressed data. We expect that records will never end up
+    // straddling two blocks.
     bool refill() {
-        if (!Compress ||
-            raw_it_ == raw_end_) {
+        if (options_.pool) {
+            return refill_ahead();
+        }
+        if (raw_it_ == raw_end_) {
             return false;
         }
 
-        uint64_t len = VarInt<22>::decode(raw_it_);
-        assert(raw_it_ + len <= raw_end_);
-        size_t zsize = ZSTD_getFrameContentSize(raw_it_,
-                                                std::distance(raw_it_,
-                                                              raw_end_));
-        if (zbuffer_.size() < zsize) {
-            zbuffer_.resize(zsize);
-        }
-        ZSTD_decompress(&zbuffer_[0],
-                        zsize,
-                        raw_it_,
-                        std::distance(raw_it_, raw_end_));
-        it_ = &zbuffer_[0];
-        end_ = it_ + zsize;
-        raw_it_ += len;
+        CompressedBlock block = CompressedBlock::parse(raw_it_);
+        assert(block.end <= raw_end_);
+        start_block(block, decode(block, &zbuffer_));
+        raw_it_ = block.end;
+        return true;
+    }
+
+    // Like refill(), but takes the next block from the ones that are
+    // being decompressed in the background, and queues up more
+    // blocks for decompression.
+    bool refill_ahead() {
+        if (current_) {
+            spare_.push_back(std::move(current_));
+        }
+        read_ahead();
+        if (ahead_.empty()) {
+            return false;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return ahead_.front()->ready; });
+            current_ = std::move(ahead_.front());
+            ahead_.pop_front();
+        }
+        read_ahead();
+        start_block(current_->block, current_->data);
         return true;
     }
 
+    // Points the decoder of the block's format at its plaintext.
+    void start_block(const CompressedBlock& block, const uint8_t* data) {
+        format_ = block.format;
+        it_ = data;
+        end_ = data + block.size;
+        if (format_ == RunFormat::kEliasFano) {
+            elias_fano_.reset(it_, end_);
+        }
+    }
+
+    // Returns true if all the records of the current block have been
+    // read.
+    bool block_done() const {
+        if (format_ == RunFormat::kEliasFano) {
+            return elias_fano_.done();
+        }
+        return it_ == end_;
+    }
+
+    // Submits blocks for decompression until options_.read_ahead
+    // blocks are in flight, or there are no more blocks.
+    void read_ahead() {
+        while (ahead_.size() < options_.read_ahead &&
+               raw_it_ != raw_end_) {
+            std::unique_ptr<DecodedBlock> decoded;
+            if (spare_.empty()) {
+                decoded.reset(new DecodedBlock);
+            } else {
+                decoded = std::move(spare_.back());
+                spare_.pop_back();
+                decoded->ready = false;
+            }
+            decoded->block = CompressedBlock::parse(raw_it_);
+            assert(decoded->block.end <= raw_end_);
+            raw_it_ = decoded->block.end;
+
+            DecodedBlock* target = decoded.get();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ahead_.push_back(std::move(decoded));
+            }
+            options_.pool->submit([this, target] {
+                    const uint8_t* data = decode(target->block,
+                                                 &target->buffer);
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    target->data = data;
+                    target->ready = true;
+                    cv_.notify_all();
+                });
+        }
+    }
+
+    // Returns the plaintext of block, decompressing it into *buffer
+    // if needed.
+    static const uint8_t* decode(const CompressedBlock& block,
+                                 std::vector<uint8_t>* buffer) {
+        auto start = std::chrono::steady_clock::now();
+        const uint8_t* data;
+        if (block.codec == BlockCodec::kNone) {
+            // No need to copy stored blocks anywhere.
+            data = block.payload;
+        } else {
+            if (buffer->size() < block.size) {
+                buffer->resize(block.size);
+            }
+            block.decompress(buffer->data());
+            data = buffer->data();
+        }
+        auto& stats = CompressionStats::get();
+        stats.decompress_ns += CompressionStats::elapsed_ns(start);
+        stats.decompress_in_bytes += block.payload_size;
+        stats.decompress_out_bytes += block.size;
+        return data;
+    }
+
     void unpack_internal(uint8_t output[Length]) {
-        uint64_t n = VarInt<Length>::decode(it_);
-        while (n) {
-            uint64_t mask = n & -n;
-            int bit = __builtin_ctzl(mask);
-            output[bit] = *it_++;
-            n ^= mask;
+        unpack_record(it_, end_, record_);
+        memcpy(output, record_, Length);
+    }
+
+    // Decodes up to n records of the current delta transformed block
+    // into out for unpack_batch(). Returns the number of records
+    // decoded, which is less than n only if the block ended.
+    size_t unpack_deltas(uint8_t* out, size_t stride, size_t n) {
+        // Work on local copies of the decoder state, since the stores
+        // to out could otherwise alias them.
+        const uint8_t* it = it_;
+        const uint8_t* end = end_;
+        uint8_t record[Kernels::kPaddedLength];
+        memcpy(record, record_, sizeof(record));
+        size_t count = 0;
+        for (; count < n && it != end; ++count, out += stride) {
+            unpack_record(it, end, record);
+            memcpy(out, record, Length);
+        }
+        memcpy(record_, record, sizeof(record));
+        it_ = it;
+        return count;
+    }
+
+    // Like unpack_deltas(), for a block in the Elias-Fano format.
+    size_t unpack_elias_fano(uint8_t* out, size_t stride, size_t n) {
+        size_t count = 0;
+        for (; count < n && !elias_fano_.done(); ++count, out += stride) {
+            uint8_t record[Length];
+            elias_fano_.next(record);
+            memcpy(out, record, Length);
+        }
+        return count;
+    }
+
+    // Applies the delta transformed record at _it_ to _output_ (which
+    // has room for Kernels::kPaddedLength bytes), and advances _it_
+    // past the record. The data ends at _end_.
+    static void unpack_record(const uint8_t*& it, const uint8_t* end,
+                              uint8_t* output) {
+        uint64_t n = VarInt<Length>::decode(it);
+        // The fast kernel can read a few bytes past the record, which
+        // is only safe if the data doesn't end right after it.
+        if (end - it >= Length + Kernels::kSlack) {
+            it = Kernels::scatter(it, n, output);
+        } else {
+            it = Kernels::scatter_scalar(it, n, output);
         }
     }
 
     // The block of data from it_ to end_ contains the delta
-    // transformed records that unpack() will return.
-    const uint8_t* it_;
-    const uint8_t* end_;
-    // The block of data from raw_it_ to raw_end_ contains data that
-    // needs to be decompressed with zstd_.
+    // transformed records that unpack() will return. Or, if the
+    // block is in the Elias-Fano format, elias_fano_ decodes the
+    // records from the block instead.
+    RunFormat format_ = RunFormat::kRadixDelta;
+    const uint8_t* it_ = NULL;
+    const uint8_t* end_ = NULL;
+    EliasFano elias_fano_;
+    // The latest record decoded from a delta transformed block.
+    uint8_t record_[Kernels::kPaddedLength] = { 0 };
+    // The block of data from raw_it_ to raw_end_ contains the blocks
+    // that haven't been decompressed yet.
     const uint8_t* raw_it_;
     const uint8_t* raw_end_;
     // A buffer for the uncompressed data.
     std::vector<uint8_t> zbuffer_;
+
+    DecompressorOptions options_;
+    // When reading ahead: the block that it_ points into, the blocks
+    // being decompressed in the background (in order), and unused
+    // blocks whose buffers can be reused.
+    std::unique_ptr<DecodedBlock> current_;
+    std::deque<std::unique_ptr<DecodedBlock>> ahead_;
+    std::vector<std::unique_ptr<DecodedBlock>> spare_;
+    std::mutex mutex_;
+    // Signaled whenever a block has been decompressed.
+    std::condition_variable cv_;
 };
 
 
 // Compresses records of _Length_ bytes to _output_, using the format
-// described above. If _Compress_ is false, only applies the radix
-// delta transform.
-template<int Length, bool Compress, class Output>
+// described above. The blocks are compressed with the format and codec
+// given in the options. Order gives the byte order of the records for
+// the Elias-Fano format.
+template<int Length, class Output, class Order = MemcmpOrder<Length>>
 class ByteArrayDeltaCompressor {
 public:
-    ByteArrayDeltaCompressor(Output* output) : output_(output) {
+    ByteArrayDeltaCompressor(Output* output,
+                             const CompressorOptions& options =
+                             CompressorOptions())
+        : options_(options),
+          output_(output) {
+        // A block can exceed the block size by one record (or one
+        // Elias-Fano partition).
+        assert(with_block_codec(options_.codec, [this] (const auto& impl) {
+                    return impl.bound(options_.block_size + kMaxRecordBytes);
+                }) + kMaxHeaderSize < (1 << 22));
     }
 
     ~ByteArrayDeltaCompressor() {
@@ -207,45 +928,70 @@ public:
     }
 
     void pack(const uint8_t value[Length]) {
+        if (!block_records_++) {
+            memcpy(block_first_, value, Length);
+        }
+        if (options_.format == RunFormat::kEliasFano) {
+            pack_elias_fano(value);
+            return;
+        }
+        reserve_record();
         // Compute a bitmask with bit N set if byte N is different
         // between "value" and the "value" given on the previous
         // call.
-        uint64_t n = 0;
-        for (int j = 0; j < Length; ++j) {
-            if (prev_[j] != value[j]) {
-                n |= 1 << j;
-            }
-        }
+        uint64_t n = Kernels::diff_mask(prev_, value);
 
-        VarInt<Length>::encode(n,
-                               [this] (uint8_t value) {
-                                   record(value);
-                               });
+        uint8_t* out = &delta_transformed_[delta_size_];
+        out = VarInt<Length>::encode(n, out);
         // Emit only the changed bytes.
-        for (int j = 0; j < Length; ++j) {
-            if (n & (1 << j)) {
-                // It's tempting to compute some kind of numeric
-                // delta here, either with xor or plus/minus. Seems
-                // like that should in theory be easier to compress
-                // with the later passes. But it didn't work for me
-                // in practice.
-                record(value[j]);
-                prev_[j] = value[j];
-            }
+        //
+        // It's tempting to compute some kind of numeric delta here,
+        // either with xor or plus/minus. Seems like that should in
+        // theory be easier to compress with the later passes. But it
+        // didn't work for me in practice.
+        out = Kernels::gather(value, n, out);
+        delta_size_ = out - &delta_transformed_[0];
+        Kernels::copy(value, prev_);
+
+        if (delta_size_ > options_.block_size) {
+            end_block();
         }
+    }
 
-        if (delta_transformed_.size() > (1 << 20)) {
-            flush();
+    // Writes out the records packed so far, followed by the
+    // compressed block from begin to end (e.g. a block of another
+    // stream with the same type of records).
+    void append_block(const uint8_t* begin, const uint8_t* end) {
+        end_block();
+        if (options_.pool) {
+            size_t max_pending = kMaxPendingBlocksPerWorker *
+                options_.pool->size();
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this, max_pending] {
+                    return pending_.size() < max_pending;
+                });
+            if (!pending_.empty()) {
+                // Queue the block to be written out by the worker
+                // that finishes the blocks before it.
+                std::unique_ptr<PendingBlock> block(new PendingBlock);
+                block->compressed.assign(begin, end);
+                block->done = true;
+                pending_.push_back(std::move(block));
+                return;
+            }
+            output_->insert_back(begin, end);
+            return;
         }
+        output_->insert_back(begin, end);
     }
 
+    // Writes out all the records packed so far, and waits for any
+    // background compression to finish.
     void flush() {
-        if (Compress) {
-            compress_and_flush();
-        } else {
-            output_->insert_back(delta_transformed_.begin(),
-                                 delta_transformed_.end());
-            delta_transformed_.clear();
+        end_block();
+        if (options_.pool) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return pending_.empty(); });
         }
     }
 
@@ -254,42 +1000,227 @@ private:
     ByteArrayDeltaCompressor& operator=(
         const ByteArrayDeltaCompressor& other) = delete;
 
-    // Buffer a byte for possible zstd compression.
-    void record(uint8_t byte) {
-        delta_transformed_.push_back(byte);
-    }
-
-    // Compress the internal accumulator buffer with zstd and write to
-    // the result to the output. The compressed data will be prefixed
-    // with a Varint representation of the length of the compressed
-    // block.
-    void compress_and_flush() {
-        char buffer[1 << 22];
-        size_t len = ZSTD_compress(buffer, sizeof(buffer),
-                                   &delta_transformed_[0],
-                                   delta_transformed_.size(),
-                                   0);
-        VarInt<22>::encode(len, [this] (uint8_t byte) {
-                output_->push_back(byte);
+    // The maximum size of the block header (the length, the tag,
+    // the plaintext length and the fence).
+    static const size_t kMaxHeaderSize =
+        VarInt<22>::kMaxBytes * 2 + 1 + VarInt<32>::kMaxBytes + 1 + Length;
+    // The number of blocks per worker of options_.pool that can be
+    // queued for compression before pack() blocks.
+    static const size_t kMaxPendingBlocksPerWorker = 2;
+
+    using Kernels = RadixDeltaKernels<Length>;
+    using EliasFano = EliasFanoWriter<Length, Order>;
+    // The space needed in delta_transformed_ for packing a record.
+    static const size_t kMaxRecordBytes = std::max<size_t>(
+        VarInt<Length>::kMaxBytes + Length + Kernels::kSlack,
+        EliasFano::kMaxPartitionBytes);
+
+    // A block that's being compressed in the background.
+    struct PendingBlock {
+        std::vector<uint8_t> plaintext;
+        uint8_t first[Length];
+        size_t records;
+        std::vector<uint8_t> compressed;
+        bool done = false;
+    };
+
+    void pack_elias_fano(const uint8_t value[Length]) {
+        reserve_record();
+        uint8_t* base = &delta_transformed_[0];
+        delta_size_ = elias_fano_.add(value, base + delta_size_) - base;
+        // Flushing the current partition must not take the block
+        // over the block size by more than one partition.
+        if (delta_size_ + EliasFano::kMaxPartitionBytes >
+            options_.block_size) {
+            end_block();
+        }
+    }
+
+    // Makes sure that delta_transformed_ has room for packing the
+    // next record.
+    void reserve_record() {
+        if (delta_transformed_.size() < delta_size_ + kMaxRecordBytes) {
+            delta_transformed_.resize(std::max(delta_size_,
+                                               options_.block_size) +
+                                      kMaxRecordBytes);
+        }
+    }
+
+    // Compresses the records buffered so far into a block, either
+    // right away or in the background.
+    void end_block() {
+        if (options_.format == RunFormat::kEliasFano) {
+            // Write out the partition that's still being collected.
+            reserve_record();
+            uint8_t* base = &delta_transformed_[0];
+            delta_size_ = elias_fano_.flush(base + delta_size_) - base;
+        }
+        if (!delta_size_) {
+            return;
+        }
+        delta_transformed_.resize(delta_size_);
+        delta_size_ = 0;
+        if (options_.pool) {
+            compress_in_background();
+        } else {
+            compress_block(delta_transformed_, block_first_, block_records_,
+                           [this] (const uint8_t* begin,
+                                   const uint8_t* end) {
+                               output_->insert_back(begin, end);
+                           });
+        }
+        // Start the next block from a clean slate, so that it can be
+        // decoded without the preceding blocks.
+        memset(prev_, 0, sizeof(prev_));
+        block_records_ = 0;
+    }
+
+    // Hands the internal accumulator buffer over to options_.pool for
+    // compression. Whichever thread finishes compressing the oldest
+    // pending block writes out all the finished blocks at the front
+    // of the queue, so the blocks are written in the order they were
+    // packed in.
+    void compress_in_background() {
+        size_t max_pending = kMaxPendingBlocksPerWorker *
+            options_.pool->size();
+        std::unique_ptr<PendingBlock> block(new PendingBlock);
+        block->plaintext.swap(delta_transformed_);
+        memcpy(block->first, block_first_, Length);
+        block->records = block_records_;
+        PendingBlock* pending = block.get();
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this, max_pending] {
+                    return pending_.size() < max_pending;
+                });
+            pending_.push_back(std::move(block));
+        }
+        options_.pool->submit([this, pending] {
+                compress_block(pending->plaintext, pending->first,
+                               pending->records,
+                               [pending] (const uint8_t* begin,
+                                          const uint8_t* end) {
+                                   pending->compressed.insert(
+                                       pending->compressed.end(),
+                                       begin, end);
+                               });
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending->done = true;
+                while (!pending_.empty() && pending_.front()->done) {
+                    const auto& compressed = pending_.front()->compressed;
+                    output_->insert_back(compressed.begin(),
+                                         compressed.end());
+                    pending_.pop_front();
+                }
+                cv_.notify_all();
+            });
+    }
+
+    // Compresses plaintext into a block of _records_ records starting
+    // with _first_, and calls write(begin, end) for each consecutive
+    // part of the block.
+    template<class Write>
+    void compress_block(const std::vector<uint8_t>& plaintext,
+                        const uint8_t first[Length], size_t records,
+                        Write write) const {
+        size_t size = plaintext.size();
+        if (options_.sampler) {
+            options_.sampler->add(&plaintext[0], size);
+        }
+        size_t bound = with_block_codec(options_.codec,
+                                        [size] (const auto& impl) {
+                                            return impl.bound(size);
+                                        });
+        uint8_t* buffer = ZstdContext::get().buffer(bound);
+        auto start = std::chrono::steady_clock::now();
+        size_t len = with_block_codec(
+            options_.codec,
+            [this, &plaintext, buffer, bound] (const auto& impl) {
+                return impl.compress(&plaintext[0], plaintext.size(),
+                                     buffer, bound, options_);
             });
-        output_->insert_back(&buffer[0], &buffer[len]);
-        delta_transformed_.clear();
+        auto& stats = CompressionStats::get();
+        stats.compress_ns += CompressionStats::elapsed_ns(start);
+        stats.compress_in_bytes += size;
+        stats.compress_out_bytes += len;
+
+        // The tag, the plaintext length and the fence, preceded by
+        // the length of the rest of the block.
+        uint8_t fields[kMaxHeaderSize];
+        uint8_t* it = fields;
+        *it++ = static_cast<uint8_t>(options_.codec) |
+            static_cast<uint8_t>(options_.format) << 4;
+        it = VarInt<22>::encode(size, it);
+        it = VarInt<32>::encode(records, it);
+        *it++ = Length;
+        memcpy(it, first, Length);
+        it += Length;
+        size_t fields_size = it - fields;
+
+        uint8_t header[kMaxHeaderSize];
+        uint8_t* header_end = VarInt<22>::encode(fields_size + len, header);
+        memcpy(header_end, fields, fields_size);
+        header_end += fields_size;
+        write(header, header_end);
+        write(&buffer[0], &buffer[len]);
     }
 
-    uint8_t prev_[Length] = { 0 };
+    CompressorOptions options_;
+    uint8_t prev_[Kernels::kPaddedLength] = { 0 };
+    // The delta transformed records of the current block are the
+    // first delta_size_ bytes of delta_transformed_. The rest is
+    // space for packing the next record into.
     std::vector<uint8_t> delta_transformed_;
+    size_t delta_size_ = 0;
+    EliasFano elias_fano_;
+    // The first record of the current block, and the number of
+    // records packed into it.
+    uint8_t block_first_[Length];
+    size_t block_records_ = 0;
     Output* output_;
+    // The blocks being compressed in the background, in the order
+    // they need to be written in. Guarded by mutex_.
+    std::deque<std::unique_ptr<PendingBlock>> pending_;
+    std::mutex mutex_;
+    // Signaled whenever blocks get written out.
+    std::condition_variable cv_;
 };
 
+// Splits a byte range that's been compressed with the outer
+// layer into at most _parts_ contiguous subranges of roughly equal
+// size. The subranges start at block boundaries, so each of them can
+// be decoded independently of the others. Returns fewer subranges
+// than requested if there are not enough blocks.
+inline std::vector<std::pair<const uint8_t*, const uint8_t*>>
+split_compressed_blocks(const uint8_t* begin, const uint8_t* end,
+                        int parts) {
+    std::vector<std::pair<const uint8_t*, const uint8_t*>> ret;
+    size_t target = std::distance(begin, end) / std::max(parts, 1);
+    const uint8_t* part_begin = begin;
+    for (const uint8_t* it = begin; it != end; ) {
+        uint64_t len = VarInt<22>::decode(it);
+        it += len;
+        assert(it <= end);
+        if (std::distance(part_begin, it) > target ||
+            it == end) {
+            ret.emplace_back(part_begin, it);
+            part_begin = it;
+        }
+    }
+    return ret;
+}
+
 // Given a byte range that's compressed/encoded as above, converts it
 // the range to a lazy stream of records of type T.
-template<class T, bool Decompress = false>
+template<class T>
 class StructureDeltaDecompressorStream {
 public:
     // Does not take ownership of the range.
     StructureDeltaDecompressorStream(const uint8_t* begin,
-                                     const uint8_t* end)
-        : stream_(begin, end) {
+                                     const uint8_t* end,
+                                     const DecompressorOptions& options =
+                                     DecompressorOptions())
+        : stream_(begin, end, options) {
     }
 
     // Returns a reference to the latest decoded record (may not be
@@ -313,8 +1244,24 @@ public:
         return !empty_;
     }
 
-    bool operator<(const StructureDeltaDecompressorStream& other) const {
-        return value_ < other.value_;
+    // Decodes the records straight into out. (The bytes() of the
+    // records in out must be sizeof(T) bytes apart).
+    size_t next_batch(T* out, size_t n) {
+        if (empty_) {
+            return 0;
+        }
+        size_t count = stream_.unpack_batch(out->bytes(), sizeof(T), n);
+        if (count < n) {
+            empty_ = true;
+        }
+        if (count) {
+            value_ = out[count - 1];
+        }
+        return count;
+    }
+
+    static bool less(const T& a, const T& b) {
+        return a < b;
     }
 
 private:
@@ -324,8 +1271,252 @@ private:
 
     T value_;
     bool empty_ = false;
-    ByteArrayDeltaDecompressor<T::width_bytes(), Decompress> stream_;
+    ByteArrayDeltaDecompressor<T::width_bytes(), T> stream_;
+};
+
+// An index of the blocks of a byte range that's been compressed with
+// the outer layer, for records of type T. Allows for starting
+// to decode a sorted range at the block containing a given record,
+// rather than from the start of the range.
+//
+// The index is built from the fences in the block headers, so none
+// of the blocks need to be decompressed for it.
+template<class T>
+class BlockIndex {
+public:
+    struct Block {
+        // The start of the block in the range.
+        const uint8_t* begin;
+        // The first record in the block.
+        T first;
+        // The number of records in the range before this block, and
+        // in this block.
+        size_t records_before;
+        size_t records;
+    };
+
+    BlockIndex() {
+    }
+
+    // Builds the index for the range from begin to end.
+    BlockIndex(const uint8_t* begin, const uint8_t* end)
+        : end_(end) {
+        size_t records = 0;
+        for (const uint8_t* it = begin; it != end; ) {
+            CompressedBlock parsed = CompressedBlock::parse(it);
+            assert(parsed.first_size == T::width_bytes());
+            Block block;
+            block.begin = it;
+            memcpy(block.first.bytes(), parsed.first, parsed.first_size);
+            block.records_before = records;
+            block.records = parsed.records;
+            blocks_.push_back(block);
+            records += parsed.records;
+            it = parsed.end;
+        }
+    }
+
+    const std::vector<Block>& blocks() const {
+        return blocks_;
+    }
+
+    // Returns the last block whose first record is not greater than
+    // _key_ (or the first block if there are no such blocks). If the
+    // indexed range is sorted, any records equal to or larger than
+    // _key_ can only be found in or after this block. The range must
+    // not be empty.
+    const Block& find(const T& key) const {
+        assert(!blocks_.empty());
+        auto it = std::upper_bound(blocks_.begin(), blocks_.end(), key,
+                                   [] (const T& key, const Block& block) {
+                                       return key < block.first;
+                                   });
+        if (it == blocks_.begin()) {
+            return *it;
+        }
+        return *(it - 1);
+    }
+
+    // The end of the given block of the index.
+    const uint8_t* block_end(const Block& block) const {
+        return &block == &blocks_.back() ? end_ : (&block + 1)->begin;
+    }
+
+    // The end of the indexed range.
+    const uint8_t* end() const {
+        return end_;
+    }
+
+private:
+    std::vector<Block> blocks_;
+    const uint8_t* end_ = NULL;
 };
 
+// A sorted stream of the records in the blocks of a BlockIndex, like
+// StructureDeltaDecompressorStream. A block is only decompressed
+// once its first record is needed, so whole blocks can be skipped
+// over without decompressing them.
+template<class T>
+class BlockIndexStream {
+public:
+    using Block = typename BlockIndex<T>::Block;
+
+    // Streams the records of the index, starting from the _block_'th
+    // block. Unlike with StructureDeltaDecompressorStream, the first
+    // record can be read without calling next() first.
+    BlockIndexStream(const BlockIndex<T>& index, size_t block,
+                     const DecompressorOptions& options =
+                     DecompressorOptions())
+        : index_(index),
+          block_(block),
+          options_(options) {
+    }
+
+    const T& value() {
+        load();
+        return stream_->value();
+    }
+
+    bool empty() {
+        load();
+        return block_ >= index_.blocks().size();
+    }
+
+    // Moves to the next record.
+    void next() {
+        load();
+        loaded_ = false;
+        if (!--left_) {
+            ++block_;
+        }
+    }
+
+    // Returns true if the next record is the first one of a block,
+    // and the block has not been decompressed yet.
+    bool at_block_start() const {
+        return !loaded_ && !left_ && block_ < index_.blocks().size();
+    }
+
+    // The block of the next record.
+    const Block& block() const {
+        return index_.blocks()[block_];
+    }
+
+    // Returns the block after block(), or NULL if it's the last one.
+    const Block* next_block() const {
+        return block_ + 1 < index_.blocks().size() ?
+            &index_.blocks()[block_ + 1] : NULL;
+    }
+
+    // Skips over the records of block(). May only be called if
+    // at_block_start() is true.
+    void skip_block() {
+        assert(at_block_start());
+        ++block_;
+        stream_.reset();
+    }
+
+private:
+    // Decodes the next record, unless that's already been done.
+    void load() {
+        if (loaded_ || block_ >= index_.blocks().size()) {
+            return;
+        }
+        if (!stream_) {
+            // The stream covers all the rest of the blocks, so that
+            // the blocks can be read ahead.
+            stream_.reset(new StructureDeltaDecompressorStream<T>(
+                              block().begin, index_.end(), options_));
+        }
+        if (!left_) {
+            left_ = block().records;
+        }
+        stream_->next();
+        assert(!stream_->empty());
+        loaded_ = true;
+    }
+
+    const BlockIndex<T>& index_;
+    // The block of the next record, and the number of records of
+    // the block that haven't been moved past yet.
+    size_t block_;
+    size_t left_ = 0;
+    // Whether stream_ has decoded the next record.
+    bool loaded_ = false;
+    std::unique_ptr<StructureDeltaDecompressorStream<T>> stream_;
+    DecompressorOptions options_;
+};
+
+// Measures the compression ratio and speed of each of the codec
+// settings on the plaintext of the blocks from begin to end, and
+// prints the results. Only the first max_bytes of plaintext are
+// used, to keep the slow codecs from taking forever.
+inline void benchmark_block_codecs(const uint8_t* begin, const uint8_t* end,
+                                   const std::vector<CompressorOptions>& codecs,
+                                   size_t max_bytes) {
+    std::vector<std::vector<uint8_t>> plaintext;
+    size_t total = 0;
+    for (const uint8_t* it = begin; it != end && total < max_bytes; ) {
+        CompressedBlock block = CompressedBlock::parse(it);
+        plaintext.emplace_back(block.size);
+        block.decompress(&plaintext.back()[0]);
+        total += block.size;
+        it = block.end;
+    }
+    if (!total) {
+        return;
+    }
+
+    printf("  codec benchmark on %ld bytes:\n", total);
+    for (const auto& options : codecs) {
+        with_block_codec(options.codec, [&] (const auto& impl) {
+                // Allocate all the buffers up front, so that the
+                // timings don't include page faults.
+                std::vector<std::vector<uint8_t>> compressed;
+                size_t max_size = 0;
+                for (const auto& block : plaintext) {
+                    compressed.emplace_back(impl.bound(block.size()));
+                    max_size = std::max(max_size, block.size());
+                }
+                std::vector<uint8_t> buffer(max_size);
+
+                size_t compressed_size = 0;
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < plaintext.size(); ++i) {
+                    auto& out = compressed[i];
+                    out.resize(impl.compress(&plaintext[i][0],
+                                             plaintext[i].size(),
+                                             &out[0], out.size(),
+                                             options));
+                    compressed_size += out.size();
+                }
+                uint64_t compress_ns = CompressionStats::elapsed_ns(start);
+
+                start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < plaintext.size(); ++i) {
+                    impl.decompress(&compressed[i][0], compressed[i].size(),
+                                    &buffer[0], plaintext[i].size());
+                }
+                uint64_t decompress_ns = CompressionStats::elapsed_ns(start);
+#ifndef NDEBUG
+                // Check the round trip outside of the timed loop.
+                for (size_t i = 0; i < plaintext.size(); ++i) {
+                    impl.decompress(&compressed[i][0], compressed[i].size(),
+                                    &buffer[0], plaintext[i].size());
+                    assert(std::equal(plaintext[i].begin(),
+                                      plaintext[i].end(), buffer.begin()));
+                }
+#endif
+
+                printf("    %-12s ratio %6.2f, compress %8.1f MB/s, "
+                       "decompress %8.1f MB/s\n",
+                       block_codec_spec(options).c_str(),
+                       (double) total / compressed_size,
+                       total * 1e3 / std::max(compress_ns, uint64_t(1)),
+                       total * 1e3 / std::max(decompress_ns, uint64_t(1)));
+            });
+    }
+}
+
 
 #endif // COMPRESS_H
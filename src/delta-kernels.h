@@ -0,0 +1,250 @@
+// -*- mode: c++ -*-
+
+#ifndef DELTA_KERNELS_H
+#define DELTA_KERNELS_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "util.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DELTA_KERNELS_X86 1
+#endif
+
+// The inner loops of the radix delta transform (see compress.h) for
+// records of _Length_ bytes:
+//
+// - diff_mask() computes the bitmask of the bytes that differ between
+//   two records, with SSE2 / AVX2 compares. copy() keeps the previous
+//   record in a padded buffer for it.
+// - gather() packs the bytes selected by a bitmask into consecutive
+//   bytes, and scatter() does the opposite. These use the BMI2
+//   PEXT / PDEP instructions on 8 bytes at a time if the CPU supports
+//   them, and a byte at a time loop otherwise.
+//
+// BMI2 support is detected at runtime, unless the code was compiled
+// for a target that's known to have it (e.g. with -march=native).
+template<int Length>
+class RadixDeltaKernels {
+public:
+    static_assert(Length <= 64, "The bitmasks are 64 bits wide");
+
+    // The number of bytes gather() may write, and scatter() may read,
+    // past the bytes selected by the bitmask.
+    static const int kSlack = 8;
+
+    // The size of the buffer that copy() writes a record to.
+    static const int kPaddedLength = (Length + 15) / 16 * 16;
+
+    // Returns a bitmask with bit N set if prev[N] != value[N]. prev
+    // must have been written by copy().
+    static uint64_t diff_mask(const uint8_t* prev, const uint8_t* value) {
+#ifdef __SSE2__
+        uint64_t equal = 0;
+        int i = 0;
+#ifdef __AVX2__
+        for (; i + 32 <= Length; i += 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i*) (prev + i));
+            __m256i y = _mm256_loadu_si256((const __m256i*) (value + i));
+            equal |= uint64_t(uint32_t(_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(x, y)))) << i;
+        }
+#endif
+        for (; i + 16 <= Length; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*) (prev + i));
+            __m128i y = _mm_loadu_si128((const __m128i*) (value + i));
+            equal |= uint64_t(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) << i;
+        }
+        if (kTail) {
+            // prev is padded, but value must not be read past its end.
+            __m128i x = _mm_loadu_si128((const __m128i*) (prev + i));
+            __m128i y = load_tail(value + i);
+            equal |= uint64_t(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) << i;
+        }
+        return ~equal & kMask;
+#else
+        uint64_t n = 0;
+        for (int j = 0; j < Length; ++j) {
+            if (prev[j] != value[j]) {
+                n |= UINT64_C(1) << j;
+            }
+        }
+        return n;
+#endif
+    }
+
+    // Copies the record at value to prev, which must have room for
+    // kPaddedLength bytes. The copy is written with the same vector
+    // stores as diff_mask() loads it with, since a load that spans
+    // multiple narrower stores would have to wait for the stores to
+    // complete.
+    static void copy(const uint8_t* value, uint8_t* prev) {
+#ifdef __SSE2__
+        int i = 0;
+#ifdef __AVX2__
+        for (; i + 32 <= Length; i += 32) {
+            _mm256_storeu_si256((__m256i*) (prev + i),
+                                _mm256_loadu_si256((const __m256i*)
+                                                   (value + i)));
+        }
+#endif
+        for (; i + 16 <= Length; i += 16) {
+            _mm_storeu_si128((__m128i*) (prev + i),
+                             _mm_loadu_si128((const __m128i*) (value + i)));
+        }
+        if (kTail) {
+            _mm_storeu_si128((__m128i*) (prev + i), load_tail(value + i));
+        }
+#else
+        memcpy(prev, value, Length);
+#endif
+    }
+
+    // Writes value[N] to out for each bit N set in mask, in order.
+    // Returns a pointer past the last byte written. Might write up to
+    // kSlack bytes of garbage past that.
+    static uint8_t* gather(const uint8_t* value, uint64_t mask,
+                           uint8_t* out) {
+        if (have_bmi2()) {
+            return gather_bmi2(value, mask, out);
+        }
+        return gather_scalar(value, mask, out);
+    }
+
+    // Sets value[N] for each bit N set in mask from the consecutive
+    // bytes starting at in. Returns a pointer past the last byte used.
+    // Might read up to kSlack bytes past that. value must have room
+    // for kPaddedLength bytes, so that it can be updated a full word
+    // at a time.
+    static const uint8_t* scatter(const uint8_t* in, uint64_t mask,
+                                  uint8_t* value) {
+        if (have_bmi2()) {
+            return scatter_bmi2(in, mask, value);
+        }
+        return scatter_scalar(in, mask, value);
+    }
+
+    // Like scatter(), but never reads past the bytes used.
+    static const uint8_t* scatter_scalar(const uint8_t* in, uint64_t mask,
+                                         uint8_t* value) {
+        while (mask) {
+            value[__builtin_ctzll(mask)] = *in++;
+            mask &= mask - 1;
+        }
+        return in;
+    }
+
+private:
+    static const uint64_t kMask =
+        Length == 64 ? ~UINT64_C(0) : (UINT64_C(1) << Length) - 1;
+    static const int kWords = (Length + 7) / 8;
+    // The number of bytes left over after the 16 byte vectors.
+    static const int kTail = Length % 16;
+
+    static uint8_t* gather_scalar(const uint8_t* value, uint64_t mask,
+                                  uint8_t* out) {
+        while (mask) {
+            *out++ = value[__builtin_ctzll(mask)];
+            mask &= mask - 1;
+        }
+        return out;
+    }
+
+    // The number of bytes in the i'th 8 byte word of a record.
+    static constexpr int word_bytes(int i) {
+        return Length - 8 * i < 8 ? Length - 8 * i : 8;
+    }
+
+    // Returns the i'th 8 byte word of a record. Only the last word
+    // can be partial.
+    static uint64_t load_record_word(const uint8_t* value, int i) {
+        const int last_bytes = word_bytes(kWords - 1);
+        if (i == kWords - 1) {
+            return load_word<last_bytes>(value + 8 * i);
+        }
+        return load_word<8>(value + 8 * i);
+    }
+
+#ifdef __SSE2__
+    // Loads the last kTail bytes of a record into the low bytes of
+    // a vector, without reading past the record.
+    static __m128i load_tail(const uint8_t* p) {
+        const int low_bytes = kTail < 8 ? (kTail ? kTail : 1) : 8;
+        const int high_bytes = kTail > 8 ? kTail - 8 : 1;
+        uint64_t low = load_word<low_bytes>(p);
+        uint64_t high = kTail > 8 ? load_word<high_bytes>(p + 8) : 0;
+        return _mm_set_epi64x(high, low);
+    }
+#endif
+
+#ifdef DELTA_KERNELS_X86
+#ifdef __BMI2__
+    static bool have_bmi2() { return true; }
+#define DELTA_KERNELS_BMI2
+#else
+    static bool have_bmi2() {
+        static const bool bmi2 = __builtin_cpu_supports("bmi2");
+        return bmi2;
+    }
+#define DELTA_KERNELS_BMI2 __attribute__((target("bmi2,popcnt")))
+#endif
+
+    DELTA_KERNELS_BMI2
+    static uint8_t* gather_bmi2(const uint8_t* value, uint64_t mask,
+                                uint8_t* out) {
+        for (int i = 0; i < kWords; ++i) {
+            uint64_t bits = (mask >> (8 * i)) & 0xff;
+            if (!bits) {
+                continue;
+            }
+            uint64_t word = load_record_word(value, i);
+            uint64_t packed = _pext_u64(word, byte_mask(bits));
+            memcpy(out, &packed, 8);
+            out += _mm_popcnt_u64(bits);
+        }
+        return out;
+    }
+
+    DELTA_KERNELS_BMI2
+    static const uint8_t* scatter_bmi2(const uint8_t* in, uint64_t mask,
+                                       uint8_t* value) {
+        for (int i = 0; i < kWords; ++i) {
+            uint64_t bits = (mask >> (8 * i)) & 0xff;
+            if (!bits) {
+                continue;
+            }
+            uint64_t bytes = byte_mask(bits);
+            uint64_t packed, word;
+            memcpy(&packed, in, 8);
+            memcpy(&word, value + 8 * i, 8);
+            word = (word & ~bytes) | _pdep_u64(packed, bytes);
+            memcpy(value + 8 * i, &word, 8);
+            in += _mm_popcnt_u64(bits);
+        }
+        return in;
+    }
+
+    // Expands each of the 8 bits to a full byte.
+    DELTA_KERNELS_BMI2
+    static uint64_t byte_mask(uint64_t bits) {
+        return _pdep_u64(bits, UINT64_C(0x0101010101010101)) * 0xff;
+    }
+#undef DELTA_KERNELS_BMI2
+#else
+    static bool have_bmi2() { return false; }
+
+    static uint8_t* gather_bmi2(const uint8_t* value, uint64_t mask,
+                                uint8_t* out) {
+        return gather_scalar(value, mask, out);
+    }
+
+    static const uint8_t* scatter_bmi2(const uint8_t* in, uint64_t mask,
+                                       uint8_t* value) {
+        return scatter_scalar(in, mask, value);
+    }
+#endif
+};
+
+#endif // DELTA_KERNELS_H
@@ -0,0 +1,330 @@
+// -*- mode: c++ -*-
+
+#ifndef ELIAS_FANO_H
+#define ELIAS_FANO_H
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include "util.h"
+
+// Elias-Fano coding of sorted runs of fixed-size records, as an
+// alternative to the radix delta transform of compress.h.
+//
+// Each record of _Length_ bytes is treated as a big integer, with
+// the bytes ordered by Order::significant_byte(i) (the index of the
+// byte that's the i'th most significant one). A sorted run is then a
+// non-decreasing sequence of integers. It's split into partitions of
+// at most kMaxPartitionSize records, each encoded as:
+//
+// <octet N: the number of records> <octet K> <K octets>
+// [<octet L> <low bits> <high bits>]
+//
+// The K octets (least significant first) are the difference between
+// the first record of the partition and the last record of the
+// previous partition, or zero for the first partition.
+//
+// The part in brackets is only there if N > 1. It encodes the offsets
+// of the other N - 1 records from the first one with Elias-Fano:
+// the low bits are the L low bits of each offset, packed together
+// starting from the least significant bit of each octet. The high
+// bits are the rest of each offset in unary: for the I'th offset,
+// bit (offset >> L) + I is set. The high bits end with the octet
+// containing the last set bit.
+//
+// A partition is ended early if the offset of the next record would
+// not fit into kMaxOffsetBits bits. So dense parts of the key space
+// take about 2 + log2(average gap) bits per record, while sparse
+// parts cost at most one full record per partition.
+
+// The byte order of records that are compared with memcmp.
+template<int Length>
+struct MemcmpOrder {
+    static constexpr int significant_byte(int i) { return i; }
+};
+
+// Arithmetic on records of _Length_ bytes as little-endian big
+// integers.
+template<int Length, class Order>
+class RecordInteger {
+public:
+    static void from_record(const uint8_t record[Length],
+                            uint8_t value[Length]) {
+        for (int i = 0; i < Length; ++i) {
+            value[i] = record[Order::significant_byte(Length - 1 - i)];
+        }
+    }
+
+    static void to_record(const uint8_t value[Length],
+                          uint8_t record[Length]) {
+        for (int i = 0; i < Length; ++i) {
+            record[Order::significant_byte(Length - 1 - i)] = value[i];
+        }
+    }
+
+    // Sets sum to a plus the _size_ byte integer b.
+    static void add(const uint8_t a[Length], const uint8_t* b, int size,
+                    uint8_t sum[Length]) {
+        unsigned carry = 0;
+        for (int i = 0; i < Length; ++i) {
+            unsigned s = a[i] + (i < size ? b[i] : 0) + carry;
+            sum[i] = s;
+            carry = s >> 8;
+        }
+    }
+
+    // Sets sum to a plus x.
+    static void add(const uint8_t a[Length], uint64_t x,
+                    uint8_t sum[Length]) {
+        unsigned carry = 0;
+        for (int i = 0; i < Length; ++i) {
+            unsigned s = a[i] + (x & 0xff) + carry;
+            sum[i] = s;
+            carry = s >> 8;
+            x >>= 8;
+        }
+    }
+
+    // Sets diff to a minus b. a must not be less than b.
+    static void subtract(const uint8_t a[Length], const uint8_t b[Length],
+                         uint8_t diff[Length]) {
+        int borrow = 0;
+        for (int i = 0; i < Length; ++i) {
+            int d = a[i] - b[i] - borrow;
+            borrow = d < 0;
+            diff[i] = d;
+        }
+        assert(!borrow);
+    }
+
+    // The number of bytes needed for value, ignoring the leading
+    // zeros.
+    static int significant_bytes(const uint8_t value[Length]) {
+        int size = Length;
+        while (size && !value[size - 1]) {
+            --size;
+        }
+        return size;
+    }
+};
+
+// Encodes a sorted run of records into partitions, in the format
+// described above.
+template<int Length, class Order>
+class EliasFanoWriter {
+public:
+    static const int kMaxPartitionSize = 128;
+    static const int kMaxOffsetBits = 56;
+    // The maximum size of an encoded partition.
+    static const size_t kMaxPartitionBytes =
+        3 + Length +
+        ((kMaxPartitionSize - 1) * (kMaxOffsetBits + 3) + 1) / 8 + 2;
+
+    // Adds the next record of the run. If it doesn't fit into the
+    // current partition, that partition is first encoded to out,
+    // which must have room for kMaxPartitionBytes. Returns a pointer
+    // past the bytes written to out.
+    uint8_t* add(const uint8_t record[Length], uint8_t* out) {
+        uint8_t value[Length];
+        Integer::from_record(record, value);
+        if (count_) {
+            uint8_t diff[Length];
+            Integer::subtract(value, first_, diff);
+            if (count_ < kMaxPartitionSize &&
+                Integer::significant_bytes(diff) <= kMaxOffsetBits / 8) {
+                uint64_t offset = 0;
+                memcpy(&offset, diff, kOffsetBytes);
+                offsets_[count_ - 1] = offset;
+                ++count_;
+                return out;
+            }
+            out = encode_partition(out);
+        }
+        memcpy(first_, value, Length);
+        count_ = 1;
+        return out;
+    }
+
+    // Encodes the current partition to out (which must have room for
+    // kMaxPartitionBytes), and starts the next partition from zero.
+    // Returns a pointer past the bytes written.
+    uint8_t* flush(uint8_t* out) {
+        if (count_) {
+            out = encode_partition(out);
+        }
+        memset(last_, 0, Length);
+        return out;
+    }
+
+private:
+    using Integer = RecordInteger<Length, Order>;
+
+    static_assert(kMaxOffsetBits % 8 == 0 && kMaxOffsetBits <= 56,
+                  "Offsets are read 8 bits at a time");
+    static const int kOffsetBytes =
+        Length < kMaxOffsetBits / 8 ? Length : kMaxOffsetBits / 8;
+
+    uint8_t* encode_partition(uint8_t* out) {
+        uint8_t gap[Length];
+        Integer::subtract(first_, last_, gap);
+        int gap_size = Integer::significant_bytes(gap);
+        *out++ = count_;
+        *out++ = gap_size;
+        memcpy(out, gap, gap_size);
+        out += gap_size;
+
+        int offsets = count_ - 1;
+        count_ = 0;
+        if (!offsets) {
+            memcpy(last_, first_, Length);
+            return out;
+        }
+
+        uint64_t universe = offsets_[offsets - 1];
+        int low_bits = universe > (uint64_t) offsets ?
+            63 - __builtin_clzll(universe / offsets) : 0;
+        *out++ = low_bits;
+
+        uint64_t acc = 0;
+        int acc_bits = 0;
+        for (int i = 0; i < offsets; ++i) {
+            acc |= (offsets_[i] & mask_n_bits(low_bits)) << acc_bits;
+            acc_bits += low_bits;
+            for (; acc_bits >= 8; acc_bits -= 8) {
+                *out++ = acc;
+                acc >>= 8;
+            }
+        }
+        if (acc_bits) {
+            *out++ = acc;
+        }
+
+        size_t high_size = ((universe >> low_bits) + offsets - 1) / 8 + 1;
+        memset(out, 0, high_size);
+        for (int i = 0; i < offsets; ++i) {
+            uint64_t bit = (offsets_[i] >> low_bits) + i;
+            out[bit / 8] |= 1 << (bit % 8);
+        }
+        out += high_size;
+
+        Integer::add(first_, universe, last_);
+        return out;
+    }
+
+    // The first record of the current partition, the offsets of the
+    // rest, and the number of records.
+    uint8_t first_[Length];
+    uint64_t offsets_[kMaxPartitionSize - 1];
+    int count_ = 0;
+    // The last record of the previous partition.
+    uint8_t last_[Length] = { 0 };
+};
+
+// Decodes the records of a range of partitions written by
+// EliasFanoWriter, one record at a time.
+template<int Length, class Order>
+class EliasFanoReader {
+public:
+    // Starts reading the partitions from begin to end.
+    void reset(const uint8_t* begin, const uint8_t* end) {
+        it_ = begin;
+        end_ = end;
+        left_ = 0;
+        memset(value_, 0, Length);
+    }
+
+    // Returns true if all the records have been read.
+    bool done() const {
+        return !left_ && it_ == end_;
+    }
+
+    // Reads the next record into record. Must not be called once
+    // done() returns true.
+    void next(uint8_t record[Length]) {
+        if (left_) {
+            Integer::add(first_, next_offset(), value_);
+        } else {
+            start_partition();
+        }
+        Integer::to_record(value_, record);
+    }
+
+private:
+    using Integer = RecordInteger<Length, Order>;
+
+    void start_partition() {
+        assert(it_ < end_);
+        int count = *it_++;
+        int gap_size = *it_++;
+        Integer::add(value_, it_, gap_size, first_);
+        it_ += gap_size;
+        memcpy(value_, first_, Length);
+
+        left_ = count - 1;
+        index_ = 0;
+        if (left_) {
+            low_bits_ = *it_++;
+            low_it_ = it_;
+            high_it_ = it_ + (left_ * low_bits_ + 7) / 8;
+            acc_ = 0;
+            acc_bits_ = 0;
+            high_byte_ = 0;
+            high_pos_ = -8;
+        }
+    }
+
+    uint64_t next_offset() {
+        uint64_t low = 0;
+        if (low_bits_) {
+            // The low bits end where the high bits start, so the
+            // refill never reads past them.
+            while (acc_bits_ < low_bits_) {
+                acc_ |= (uint64_t) *low_it_++ << acc_bits_;
+                acc_bits_ += 8;
+            }
+            low = acc_ & mask_n_bits(low_bits_);
+            acc_ >>= low_bits_;
+            acc_bits_ -= low_bits_;
+        }
+
+        while (!high_byte_) {
+            high_byte_ = *high_it_++;
+            high_pos_ += 8;
+        }
+        uint64_t high = high_pos_ + __builtin_ctz(high_byte_) - index_;
+        high_byte_ &= high_byte_ - 1;
+        ++index_;
+
+        if (!--left_) {
+            // The partition ends with the octet of the last set bit.
+            it_ = high_it_;
+            assert(it_ <= end_);
+        }
+        return high << low_bits_ | low;
+    }
+
+    // The partitions that haven't been started yet.
+    const uint8_t* it_ = NULL;
+    const uint8_t* end_ = NULL;
+    // The first record of the current partition, and the latest
+    // record read.
+    uint8_t first_[Length];
+    uint8_t value_[Length] = { 0 };
+    // The number of offsets left in the current partition, and the
+    // index of the next one.
+    int left_ = 0;
+    int index_ = 0;
+    // The low bits of the offsets.
+    int low_bits_ = 0;
+    const uint8_t* low_it_ = NULL;
+    uint64_t acc_ = 0;
+    int acc_bits_ = 0;
+    // The high bits of the offsets. high_byte_ has the bits of the
+    // octet starting at bit high_pos_ that haven't been used yet.
+    const uint8_t* high_it_ = NULL;
+    unsigned high_byte_ = 0;
+    int64_t high_pos_ = 0;
+};
+
+#endif // ELIAS_FANO_H
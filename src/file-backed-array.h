@@ -8,6 +8,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <string>
 #include <vector>
 
 #include <fcntl.h>
@@ -18,15 +19,23 @@
 
 // A roughly vector-like class which is to start with stored in
 // normal memory. But if the total size of the array grows to
-// more than kFlushThreshold bytes, starts instead storing
-// the bulk of the data on disk (with access to the data
-// provided with mmap).
-template<class T,
-         // 100M
-         size_t kFlushThreshold = 100000000 / sizeof(T)>
+// more than its buffer size, starts instead storing the bulk of
+// the data on disk (with access to the data provided with mmap).
+// After that, the buffer is only used for batching up writes.
+//
+// The array can also be persisted to a named file (e.g. for
+// checkpointing), in which case the file will be kept around after
+// the array is destroyed, and can later be reopened with restore().
+template<class T>
 class file_backed_mmap_array {
 public:
-    file_backed_mmap_array() {
+    // The default buffer size: 100M.
+    static const size_t kDefaultBufferBytes = 100000000;
+
+    // An empty array that buffers up to buffer_bytes bytes in
+    // memory.
+    explicit file_backed_mmap_array(size_t buffer_bytes = kDefaultBufferBytes)
+        : buffer_bytes_(buffer_bytes) {
         freeze();
     }
 
@@ -34,9 +43,11 @@ public:
 
     file_backed_mmap_array(file_backed_mmap_array&& other)
         : buffer_(std::move(other.buffer_)),
+          buffer_bytes_(other.buffer_bytes_),
           frozen_(other.frozen_),
           size_(other.size_),
           fd_(other.fd_),
+          path_(std::move(other.path_)),
           array_(other.array_) {
         other.array_ = NULL;
         other.fd_ = -1;
@@ -45,9 +56,11 @@ public:
     void operator=(file_backed_mmap_array&& other) {
         maybe_close();
         buffer_ = std::move(other.buffer_);
+        buffer_bytes_ = other.buffer_bytes_;
         frozen_ = other.frozen_;
         size_ = other.size_;
         fd_ = other.fd_;
+        path_ = std::move(other.path_);
         array_ = other.array_;
         other.array_ = NULL;
         other.fd_ = -1;
@@ -68,6 +81,12 @@ public:
         }
     }
 
+    // Sets the number of bytes to buffer in memory before writing
+    // them to disk. Takes effect on the next write.
+    void set_buffer_bytes(size_t bytes) {
+        buffer_bytes_ = bytes;
+    }
+
     // Returns true iff the is storing no elements.
     bool empty() const { return size_ == 0; }
 
@@ -112,12 +131,22 @@ public:
     }
 
     // Inserts a range of objects from begin to at the end
-    // of the array.
+    // of the array. A range larger than the buffer is written out
+    // a buffer at a time.
     template<class It>
-    void insert_back(const It begin, const It end) {
-        buffer_.insert(buffer_.end(), begin, end);
-        size_ += std::distance(begin, end);
-        maybe_flush();
+    void insert_back(It begin, const It end) {
+        size_t capacity = std::max<size_t>(1, buffer_bytes_ / sizeof(T));
+        while (begin != end) {
+            size_t room = capacity > buffer_.size() ?
+                capacity - buffer_.size() : 1;
+            It chunk_end = begin;
+            std::advance(chunk_end, std::min<size_t>(
+                room, std::distance(begin, end)));
+            buffer_.insert(buffer_.end(), begin, chunk_end);
+            size_ += std::distance(begin, chunk_end);
+            maybe_flush();
+            begin = chunk_end;
+        }
     }
 
     // Prepares the array for reading. No mutating operations
@@ -185,6 +214,86 @@ public:
         return run_ends_.size();
     }
 
+    // The element offsets of the starts / ends of all the recorded
+    // runs.
+    const std::vector<size_t>& run_starts() const { return run_starts_; }
+    const std::vector<size_t>& run_ends() const { return run_ends_; }
+
+    // Makes the array be backed by the file at path, writing the
+    // full contents of the array to it. Once this is done, the data
+    // will be kept in that file. It won't be truncated or deleted
+    // when the array is destroyed.
+    //
+    // If the array is already backed by that file, just makes sure
+    // that all the data has reached the disk.
+    //
+    // The array must be frozen.
+    void persist(const std::string& path) {
+        assert(frozen_);
+        if (path_ != path) {
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                perror(path.c_str());
+                abort();
+            }
+            write_fully(fd, (const char*) array_, sizeof(T) * size_);
+            maybe_close();
+            buffer_.clear();
+            fd_ = fd;
+            path_ = path;
+            frozen_ = false;
+            maybe_map(PROT_READ, MAP_SHARED);
+        }
+        if (fdatasync(fd_) != 0) {
+            perror("fdatasync");
+            abort();
+        }
+    }
+
+    // Makes an empty array be backed by a new file at path, like
+    // persist() would, but before anything has been written to the
+    // array. The data then goes straight to that file, and a later
+    // persist() to the same path only needs to sync it.
+    void create(const std::string& path) {
+        assert(frozen_ && empty() && fd_ == -1);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror(path.c_str());
+            abort();
+        }
+        fd_ = fd;
+        path_ = path;
+    }
+
+    // Makes an empty array be backed by the file at path, which
+    // was previously written with persist(). The first size elements
+    // of the file become the contents of the array (with anything
+    // after that discarded), with the given run boundaries.
+    void restore(const std::string& path, size_t size,
+                 const std::vector<size_t>& run_starts,
+                 const std::vector<size_t>& run_ends) {
+        assert(frozen_ && empty() && fd_ == -1);
+        int fd = ::open(path.c_str(), O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            perror(path.c_str());
+            abort();
+        }
+        if (st.st_size < sizeof(T) * size ||
+            ftruncate(fd, sizeof(T) * size) != 0) {
+            fprintf(stderr, "%s: truncated file\n", path.c_str());
+            abort();
+        }
+        lseek(fd, 0, SEEK_END);
+        fd_ = fd;
+        path_ = path;
+        size_ = size;
+        run_starts_ = run_starts;
+        run_ends_ = run_ends;
+        frozen_ = false;
+        maybe_map(PROT_READ, MAP_SHARED);
+    }
+
     struct WriteRun {
         WriteRun(file_backed_mmap_array* array) : array_(array) {
             array_->thaw();
@@ -214,14 +323,27 @@ private:
     }
 
     // If the array has a backing file, unmaps and closes the file.
+    // Temporary files are truncated, persisted ones are kept.
     void maybe_close() {
         if (fd_ >= 0) {
-            maybe_unmap(true);
+            maybe_unmap(path_.empty());
             close(fd_);
             fd_ = -1;
         }
     }
 
+    static void write_fully(int fd, const char* data, size_t bytes) {
+        while (bytes) {
+            ssize_t written = write(fd, data, bytes);
+            if (written < 0) {
+                perror("write");
+                abort();
+            }
+            data += written;
+            bytes -= written;
+        }
+    }
+
     // Opens a backing file for this array in the current working
     // directory.
     void open() {
@@ -235,7 +357,7 @@ private:
 
     // Flushes the array to disk, if the array is large enough.
     void maybe_flush() {
-        if (buffer_.size() >= kFlushThreshold) {
+        if (buffer_.size() * sizeof(T) >= buffer_bytes_) {
             if (fd_ == -1) {
                 open();
             }
@@ -251,6 +373,9 @@ private:
         assert(!frozen_);
         if (fd_ >= 0 && size_ > 0) {
             flush();
+            // All the data is in the file, so the buffer doesn't need
+            // to hold on to its memory until the next write.
+            std::vector<T>().swap(buffer_);
             size_t len = sizeof(T) * size_;
             void* map = mmap(NULL, len, prot, flags, fd_, 0);
             if (map == MAP_FAILED) {
@@ -269,12 +394,17 @@ private:
     // Elements that have been written to end of the array, but
     // not flushed to disk.
     std::vector<T> buffer_;
+    // The maximum size of buffer_ in bytes, before it gets written
+    // to disk.
+    size_t buffer_bytes_;
     bool frozen_ = false;
     // The number of elements in the array.
     size_t size_ = 0;
     // The file descriptor of the backing file; -1 if the array
     // does not yet have a backing file.
     int fd_ = -1;
+    // The name of the backing file, if the array has been persisted.
+    std::string path_;
     // A pointer to the start of the backing store (whether a mmaped
     // view of the backing file, or the in-memory buffer).
     T* array_ = NULL;
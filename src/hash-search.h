@@ -0,0 +1,279 @@
+// -*- mode: c++ -*-
+
+#ifndef HASH_SEARCH_H
+#define HASH_SEARCH_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+#include "search.h"
+
+// A breadth first search that keeps all the states in an in-memory
+// hash table. For small state spaces this is much faster than
+// BreadthFirstSearch, since there's no need to sort, compress or
+// merge anything. The template parameters are the same as for
+// BreadthFirstSearch.
+//
+// The search finds the same solution as BreadthFirstSearch would:
+// the values of the states follow the same rules, ties between
+// winning states are broken the same way, and the solution path
+// is traced from the states of each depth in sorted order.
+template<class State, class FixedState,
+         class Policy = BFSPolicy<State, FixedState>,
+         class PackedState = typename State::Packed>
+class HashTableSearch {
+public:
+    using Key = PackedState;
+    // The hash code of the parent state that generated the state.
+    using Value = uint8_t;
+    using st_pair = std::pair<Key, Value>;
+    // The states first reached at each depth of the search, with
+    // their values.
+    using Layers = std::vector<std::vector<st_pair>>;
+
+    // Creates a search that will use at most max_bytes of memory
+    // for its data structures.
+    explicit HashTableSearch(size_t max_bytes)
+        : max_bytes_(max_bytes) {
+    }
+
+    // Execute a search from start_state to any win state. Returns
+    // the depth of the solution, or 0 if there is no solution.
+    //
+    // If the search would need more than max_bytes of memory, gives
+    // up and returns -1. All the fully expanded depths, plus the
+    // unexpanded states of the next depth, are then moved to
+    // *layers so that BreadthFirstSearch can continue the search.
+    int search(State start_state, const FixedState& setup, Layers* layers) {
+        table_.assign(kInitialCapacity, Entry());
+        count_ = 0;
+        layers_.assign(1, std::vector<Key>());
+        add(Key(start_state), 0, 0);
+
+        for (int iter = 0; ; ++iter) {
+            Policy::start_iteration(iter);
+
+            if (layers_[iter].empty()) {
+                // We haven't won, and have no moves to process.
+                return 0;
+            }
+            layers_.emplace_back();
+
+            generated_ = 0;
+            bool win = false;
+            bool overflow = false;
+            Key win_parent;
+            st_pair win_state;
+
+            for (size_t i = 0; i < layers_[iter].size(); ++i) {
+                Key key = layers_[iter][i];
+                State st(key);
+                Value parent_hash = key.hash() & 0xff;
+                st_pair child_win;
+
+                bool won = st.do_valid_moves(
+                    setup,
+                    [&] (State new_state) {
+                        Key child(new_state);
+                        if (!add(child, parent_hash, iter + 1)) {
+                            overflow = true;
+                            return true;
+                        }
+                        if (new_state.win()) {
+                            child_win = st_pair(child, parent_hash);
+                            return true;
+                        }
+                        return false;
+                    });
+                if (overflow) {
+                    printf("  out of memory for the hash table, "
+                           "switching to the external memory search\n");
+                    release_layers(iter, layers);
+                    return -1;
+                }
+                // BreadthFirstSearch visits the states in sorted
+                // order, and picks the last win state it finds.
+                if (won && (!win || win_parent < key)) {
+                    win = true;
+                    win_parent = key;
+                    win_state = child_win;
+                }
+            }
+
+            printf("  new states: %ld\n", generated_);
+            printf("  new unique: %ld\n", layers_[iter + 1].size());
+            fflush(stdout);
+
+            if (win) {
+                return trace_solution_path(setup, win_state);
+            }
+        }
+    }
+
+private:
+    static const size_t kInitialCapacity = 1024;
+    static const uint16_t kEmpty = 0xffff;
+
+    struct Entry {
+        Key key;
+        Value value;
+        // The depth at which the state was first reached, or kEmpty
+        // for unused entries.
+        uint16_t depth = kEmpty;
+        // The latest depth at which the state was generated.
+        uint16_t generated = kEmpty;
+    };
+
+    // Adds a state reached at the given depth to the table. If the
+    // state was already reached at the same depth, keeps the smallest
+    // value. If it was reached at an earlier depth, does nothing
+    // besides counting it in generated_.
+    //
+    // Returns false if the table would grow too large.
+    bool add(const Key& key, Value value, int depth) {
+        Entry* entry = find(key);
+        if (entry->depth != kEmpty) {
+            if (entry->depth == depth) {
+                entry->value = std::min(entry->value, value);
+            }
+            if (entry->generated != depth) {
+                entry->generated = depth;
+                ++generated_;
+            }
+            return true;
+        }
+
+        if ((count_ + 1) * 4 > table_.size() * 3) {
+            if (!grow()) {
+                return false;
+            }
+            entry = find(key);
+        }
+        if (memory_use(table_.size(), count_ + 1) > max_bytes_) {
+            return false;
+        }
+
+        entry->key = key;
+        entry->value = value;
+        entry->depth = depth;
+        entry->generated = depth;
+        ++count_;
+        ++generated_;
+        layers_[depth].push_back(key);
+        return true;
+    }
+
+    // Returns the entry containing key, or the empty entry where
+    // key should be inserted.
+    Entry* find(const Key& key) {
+        size_t mask = table_.size() - 1;
+        for (size_t i = key.hash() & mask; ; i = (i + 1) & mask) {
+            Entry* entry = &table_[i];
+            if (entry->depth == kEmpty || entry->key == key) {
+                return entry;
+            }
+        }
+    }
+
+    // Doubles the capacity of the table. Returns false if the new
+    // table would use too much memory.
+    bool grow() {
+        size_t capacity = table_.size() * 2;
+        // Both the old and the new tables are live while rehashing.
+        if (memory_use(capacity + table_.size(), count_) > max_bytes_) {
+            return false;
+        }
+
+        std::vector<Entry> old(capacity);
+        old.swap(table_);
+        for (const auto& entry : old) {
+            if (entry.depth != kEmpty) {
+                *find(entry.key) = entry;
+            }
+        }
+        return true;
+    }
+
+    // The memory needed for a table with the given capacity holding
+    // the given number of states.
+    static size_t memory_use(size_t capacity, size_t count) {
+        return capacity * sizeof(Entry) + count * sizeof(Key);
+    }
+
+    // Moves depths 0 to last (inclusive) to *layers, and frees the
+    // rest of the search state.
+    void release_layers(int last, Layers* layers) {
+        layers->clear();
+        for (int depth = 0; depth <= last; ++depth) {
+            layers->emplace_back();
+            auto& layer = layers->back();
+            layer.reserve(layers_[depth].size());
+            for (const auto& key : layers_[depth]) {
+                layer.emplace_back(key, find(key)->value);
+            }
+            std::vector<Key>().swap(layers_[depth]);
+        }
+        layers_.clear();
+        std::vector<Entry>().swap(table_);
+        count_ = 0;
+    }
+
+    // Works backwards from the winning state to the start state,
+    // calling Policy::trace on each state. Works the same way as
+    // BreadthFirstSearch::trace_solution_path, including visiting the
+    // candidate parents in sorted order.
+    int trace_solution_path(const FixedState& setup,
+                            const st_pair win_state) {
+        st_pair target = win_state;
+
+        int depth = layers_.size();
+
+        for (int i = depth - 1; i > 0; --i) {
+            Policy::trace(setup, State(target.first), i);
+
+            auto& layer = layers_[i - 1];
+            std::sort(layer.begin(), layer.end());
+
+            bool found_next = false;
+            for (const auto& key : layer) {
+                // Only states whose hash matches the value of the
+                // current state can be its parent.
+                if ((key.hash() & 0xff) != (target.second & 0xff)) {
+                    continue;
+                }
+
+                State st(key);
+                if (st.do_valid_moves(setup,
+                                      [&target](State new_state) {
+                                          Key p(new_state);
+                                          return p == target.first;
+                                      })) {
+                    target = st_pair(key, find(key)->value);
+                    found_next = true;
+                    break;
+                }
+            }
+            assert(found_next);
+        }
+        Policy::trace(setup, State(target.first), 0);
+
+        return depth - 1;
+    }
+
+    size_t max_bytes_;
+    // An open addressing hash table (with linear probing) of all
+    // the states seen so far. The size is always a power of two.
+    std::vector<Entry> table_;
+    // The number of used entries in table_.
+    size_t count_ = 0;
+    // The number of distinct states generated from the current
+    // depth, including ones that had been reached earlier.
+    size_t generated_ = 0;
+    // The states first reached at each depth, in the order they
+    // were reached.
+    std::vector<std::vector<Key>> layers_;
+};
+
+#endif // HASH_SEARCH_H
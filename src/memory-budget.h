@@ -0,0 +1,119 @@
+// -*- mode: c++ -*-
+
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+// The amount of memory the search may use for its buffers, and how
+// it's divided between them. Fixed size structures (like a Bloom
+// filter) are taken off the top, and the rest is split as follows:
+//
+// - Half for the new states collected before they're sorted into a
+//   run. The sort needs scratch space of the same size, so the
+//   states themselves get a quarter.
+// - An eighth for reading all the sorted runs that are being read at
+//   the same time: their decompressed blocks, and the batches of
+//   records read from them.
+// - A 16th for the in-memory buffers of all the
+//   file_backed_mmap_arrays. The owner of each group of arrays that
+//   are alive at the same time gets a fixed part of this, and divides
+//   it between its arrays with split_array_buffers().
+//
+// The rest is left for the page cache of the files backing the
+// arrays.
+class MemoryBudget {
+public:
+    // A budget of _bytes_ bytes, of which _fixed_bytes_ are used by
+    // fixed size structures. If bytes is 0, the budget is half of the
+    // memory available to the process. Aborts if the fixed size
+    // structures would leave less than half of the budget for the
+    // buffers.
+    explicit MemoryBudget(size_t bytes = 0, size_t fixed_bytes = 0)
+        : bytes_(bytes ? bytes : available_bytes() / 2),
+          buffer_bytes_(bytes_ - std::min(bytes_, fixed_bytes)) {
+        if (fixed_bytes > bytes_ / 2) {
+            fprintf(stderr, "A memory budget of %ld MB is too small for "
+                    "%ld MB of fixed size structures\n",
+                    bytes_ >> 20, fixed_bytes >> 20);
+            abort();
+        }
+    }
+
+    size_t bytes() const { return bytes_; }
+
+    // The maximum size of the new states to collect in memory.
+    size_t new_state_bytes() const { return buffer_bytes_ / 4; }
+
+    // The maximum size of the buffers for reading sorted runs.
+    size_t read_bytes() const { return buffer_bytes_ / 8; }
+
+    // The maximum total size of the data that the
+    // file_backed_mmap_arrays may keep in memory before spilling it
+    // to their files.
+    size_t array_buffer_bytes() const { return buffer_bytes_ / 16; }
+
+    // The buffer size to give each of _arrays_ arrays that share
+    // _bytes_ bytes of buffers. Never less than a size that still
+    // makes for efficient writes, even if that goes over _bytes_.
+    static size_t split_array_buffers(size_t bytes, size_t arrays) {
+        return std::max(bytes / std::max<size_t>(arrays, 1),
+                        size_t(kMinArrayBufferBytes));
+    }
+
+    // Returns the memory available to the process: the memory limit
+    // of its cgroup if it has one, otherwise the physical memory of
+    // the machine.
+    static size_t available_bytes() {
+        size_t bytes = physical_bytes();
+        // cgroup v2, then v1. The limit is "max" or a huge number if
+        // there isn't one.
+        for (const char* path : { "/sys/fs/cgroup/memory.max",
+                    "/sys/fs/cgroup/memory/memory.limit_in_bytes" }) {
+            size_t limit = 0;
+            if (read_limit(path, &limit) && limit) {
+                bytes = std::min(bytes, limit);
+            }
+        }
+        return bytes;
+    }
+
+private:
+    static const size_t kMinArrayBufferBytes = 64 << 10;
+
+    static size_t physical_bytes() {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long page_size = sysconf(_SC_PAGE_SIZE);
+        if (pages <= 0 || page_size <= 0) {
+            return SIZE_MAX;
+        }
+        return (size_t) pages * page_size;
+    }
+
+    static bool read_limit(const char* path, size_t* limit) {
+        FILE* file = fopen(path, "r");
+        if (!file) {
+            return false;
+        }
+        char buffer[64] = { 0 };
+        bool ok = fgets(buffer, sizeof(buffer), file) != NULL &&
+            strncmp(buffer, "max", 3) != 0;
+        fclose(file);
+        if (ok) {
+            *limit = strtoull(buffer, NULL, 10);
+        }
+        return ok;
+    }
+
+    size_t bytes_;
+    // The part of bytes_ that's not used by fixed size structures.
+    size_t buffer_bytes_;
+};
+
+#endif // MEMORY_BUDGET_H
@@ -0,0 +1,250 @@
+// Benchmarks SortedStreamInterleaver against the binary heap based
+// merge it replaced, for merging k = 2 ... 256 sorted runs of keys.
+//
+// Usage: merge-bench [records]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "util.h"
+
+// A 16 byte key, ordered like the packed states of the search.
+class BenchKey {
+public:
+    static constexpr int width_bytes() { return 16; }
+
+    uint8_t* bytes() { return bytes_; }
+    const uint8_t* bytes() const { return bytes_; }
+
+    static constexpr int significant_byte(int i) {
+        return (i / 8) * 8 + 7 - i % 8;
+    }
+
+    bool operator==(const BenchKey& other) const {
+        return memcmp(bytes_, other.bytes_, sizeof(bytes_)) == 0;
+    }
+
+    bool operator<(const BenchKey& other) const {
+        for (int i = 0; i < 16; i += 8) {
+            uint64_t a, b;
+            memcpy(&a, bytes_ + i, sizeof(a));
+            memcpy(&b, other.bytes_ + i, sizeof(b));
+            if (a != b) {
+                return a < b;
+            }
+        }
+        return false;
+    }
+
+private:
+    uint8_t bytes_[16];
+};
+
+// A Stream over a sorted vector of keys.
+class VectorStream {
+public:
+    explicit VectorStream(const std::vector<BenchKey>& keys)
+        : it_(keys.data() - 1), end_(keys.data() + keys.size()) {
+    }
+
+    bool empty() const { return it_ == end_; }
+    bool next() { ++it_; return !empty(); }
+    const BenchKey& value() const { return *it_; }
+
+    size_t next_batch(BenchKey* out, size_t n) {
+        size_t count = 0;
+        while (count < n && !empty() && next()) {
+            out[count++] = *it_;
+        }
+        return count;
+    }
+
+    // The order of the streams for HeapStreamInterleaver, and of the
+    // records for SortedStreamInterleaver.
+    bool operator<(const VectorStream& other) const {
+        return *it_ < *other.it_;
+    }
+
+    static bool less(const BenchKey& a, const BenchKey& b) {
+        return a < b;
+    }
+
+private:
+    const BenchKey* it_;
+    const BenchKey* end_;
+};
+
+// The merge that SortedStreamInterleaver used to do, with a
+// std::priority_queue of the streams.
+template<class T, class Stream>
+struct HeapStreamInterleaver {
+    ~HeapStreamInterleaver() {
+        while (!streams_.empty()) {
+            delete streams_.top();
+            streams_.pop();
+        }
+    }
+
+    void add_stream(Stream* stream) {
+        if (stream->next()) {
+            streams_.push(stream);
+            empty_ = false;
+        } else {
+            delete stream;
+        }
+    }
+
+    bool empty() {
+        return empty_;
+    }
+
+    bool next() {
+        if (streams_.empty()) {
+            empty_ = true;
+            return false;
+        }
+
+        auto top_stream = streams_.top();
+        T value = top_stream->value();
+        streams_.pop();
+        if (top_stream->next()) {
+            streams_.push(top_stream);
+        } else {
+            delete top_stream;
+        }
+
+        if (have_top_ && value == top_) {
+            return next();
+        }
+
+        top_ = value;
+        have_top_ = true;
+        return true;
+    }
+
+    const T& value() const {
+        return top_;
+    }
+
+private:
+    T top_;
+    bool have_top_ = false;
+    bool empty_ = false;
+
+    struct Cmp {
+        bool operator()(const Stream* a, const Stream* b) {
+            return *b < *a;
+        }
+    };
+
+    std::priority_queue<Stream*, std::vector<Stream*>, Cmp> streams_;
+};
+
+// The number of times to repeat each merge.
+static const int kRepeats = 3;
+
+// Splits the keys into k sorted runs.
+std::vector<std::vector<BenchKey>> make_runs(
+    const std::vector<BenchKey>& keys, int k, std::mt19937_64* rng) {
+    std::vector<std::vector<BenchKey>> runs(k);
+    for (const auto& key : keys) {
+        runs[(*rng)() % k].push_back(key);
+    }
+    for (auto& run : runs) {
+        std::sort(run.begin(), run.end());
+        run.erase(std::unique(run.begin(), run.end()), run.end());
+    }
+    return runs;
+}
+
+// Merges the runs with an Interleaver. Returns the time taken in
+// seconds, and sets *count and *checksum from the output.
+template<class Interleaver>
+double merge_once(const std::vector<std::vector<BenchKey>>& runs,
+                  size_t* count, uint64_t* checksum) {
+    auto start = std::chrono::steady_clock::now();
+    Interleaver interleaver;
+    for (const auto& run : runs) {
+        interleaver.add_stream(new VectorStream(run));
+    }
+    *count = 0;
+    *checksum = 0;
+    while (interleaver.next()) {
+        uint64_t word;
+        memcpy(&word, interleaver.value().bytes(), sizeof(word));
+        *checksum = *checksum * 31 + word;
+        ++*count;
+    }
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Like merge_once, but returns the best time of a few merges.
+template<class Interleaver>
+double merge(const std::vector<std::vector<BenchKey>>& runs,
+             size_t* count, uint64_t* checksum) {
+    double best = merge_once<Interleaver>(runs, count, checksum);
+    for (int i = 1; i < kRepeats; ++i) {
+        best = std::min(best, merge_once<Interleaver>(runs, count, checksum));
+    }
+    return best;
+}
+
+// Benchmarks the merges on keys whose first 8 bytes take just
+// _distinct_ values (or are uniformly random if 0), with about one
+// in ten keys being duplicates.
+void benchmark(size_t records, uint64_t distinct) {
+    std::mt19937_64 rng(1);
+    std::vector<BenchKey> keys(records);
+    for (size_t i = 0; i < records; ++i) {
+        if (i % 10 == 9) {
+            keys[i] = keys[rng() % i];
+            continue;
+        }
+        uint64_t words[2] = { rng(), rng() };
+        if (distinct) {
+            words[0] %= distinct;
+        }
+        memcpy(keys[i].bytes(), words, sizeof(words));
+    }
+
+    printf("%ld records, %s first 8 bytes\n", records,
+           distinct ? "mostly equal" : "random");
+    printf("%6s %12s %12s %12s\n", "k", "heap Mrec/s", "tree Mrec/s",
+           "prefix Mrec/s");
+    for (int k = 2; k <= 256; k *= 2) {
+        auto runs = make_runs(keys, k, &rng);
+        size_t heap_count, tree_count, prefix_count;
+        uint64_t heap_sum, tree_sum, prefix_sum;
+        double heap = merge<HeapStreamInterleaver<BenchKey, VectorStream>>(
+            runs, &heap_count, &heap_sum);
+        double tree = merge<SortedStreamInterleaver<BenchKey, VectorStream>>(
+            runs, &tree_count, &tree_sum);
+        double prefix = merge<SortedStreamInterleaver<
+            BenchKey, VectorStream, true, KeyPrefix<BenchKey>>>(
+                runs, &prefix_count, &prefix_sum);
+        if (heap_count != tree_count || heap_sum != tree_sum ||
+            heap_count != prefix_count || heap_sum != prefix_sum) {
+            fprintf(stderr, "k=%d: merges disagree\n", k);
+            abort();
+        }
+        printf("%6d %12.1f %12.1f %12.1f\n", k,
+               heap_count / heap / 1e6, tree_count / tree / 1e6,
+               prefix_count / prefix / 1e6);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t records = argc > 1 ? atol(argv[1]) : 4000000;
+    benchmark(records, 0);
+    benchmark(records, 16);
+    return 0;
+}
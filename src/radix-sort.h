@@ -0,0 +1,208 @@
+// -*- mode: c++ -*-
+
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include "util.h"
+
+// Sorts vectors of (Key, Value) pairs by key with a MSD radix sort,
+// and removes pairs with duplicate keys. This is much faster than a
+// comparison based sort for the wide fixed-width keys used by the
+// search, since every comparison of two keys is a loop over the
+// bytes of the keys.
+//
+// Key must have the following static methods, in addition to
+// operator< and operator==:
+//
+// - width_bytes(): The width of the key.
+// - significant_byte(i): The index of the byte that's the i'th most
+//   significant one in the order defined by operator<.
+//
+// Value must be totally ordered by operator<.
+template<class Key, class Value>
+class PairRadixSorter {
+public:
+    using Pair = std::pair<Key, Value>;
+
+    PairRadixSorter() {
+        for (int i = 0; i < kWidth; ++i) {
+            order_[i] = Key::significant_byte(i);
+        }
+    }
+
+    // Sorts the pairs by key, and then calls emit(pair) for each
+    // distinct key in order. If there are multiple pairs with the
+    // same key, only the one with the smallest value is emitted.
+    //
+    // The sort is done using up to _threads_ threads: the pairs
+    // are first distributed into buckets by their most significant
+    // byte, and the buckets are then sorted and deduplicated in
+    // parallel. emit is always called from the calling thread.
+    //
+    // Leaves the contents of *pairs in an unspecified state.
+    template<class Fun>
+    void sort_unique(std::vector<Pair>* pairs, int threads, Fun emit) {
+        size_t n = pairs->size();
+        if (threads <= 1 || n < kMinParallelSize) {
+            Pair* begin = pairs->data();
+            size_t count = sort_unique_bucket(begin, n, 0);
+            for (size_t i = 0; i < count; ++i) {
+                emit(begin[i]);
+            }
+            return;
+        }
+
+        // Count the number of keys with each top byte value, in
+        // separate chunks of the input.
+        size_t chunk_size = (n + threads - 1) / threads;
+        std::vector<size_t> counts(threads * kBuckets);
+        run_parallel(threads, [&] (int t) {
+                size_t* count = &counts[t * kBuckets];
+                size_t end = std::min(n, (t + 1) * chunk_size);
+                for (size_t i = t * chunk_size; i < end; ++i) {
+                    ++count[byte((*pairs)[i], 0)];
+                }
+            });
+
+        // Compute where each chunk should write the keys in each
+        // bucket. Buckets are contiguous, and each bucket has the
+        // keys from chunk 0 first, then chunk 1, etc.
+        std::vector<size_t> bucket_start(kBuckets + 1);
+        std::vector<size_t> offsets(threads * kBuckets);
+        size_t at = 0;
+        for (int b = 0; b < kBuckets; ++b) {
+            bucket_start[b] = at;
+            for (int t = 0; t < threads; ++t) {
+                offsets[t * kBuckets + b] = at;
+                at += counts[t * kBuckets + b];
+            }
+        }
+        bucket_start[kBuckets] = at;
+
+        scratch_.resize(n);
+        run_parallel(threads, [&] (int t) {
+                size_t* offset = &offsets[t * kBuckets];
+                size_t end = std::min(n, (t + 1) * chunk_size);
+                for (size_t i = t * chunk_size; i < end; ++i) {
+                    const Pair& pair = (*pairs)[i];
+                    scratch_[offset[byte(pair, 0)]++] = pair;
+                }
+            });
+
+        // Sort and deduplicate the buckets independently of each
+        // other.
+        std::vector<size_t> unique(kBuckets);
+        std::atomic<int> next_bucket { 0 };
+        run_parallel(threads, [&] (int t) {
+                for (int b; (b = next_bucket++) < kBuckets; ) {
+                    unique[b] = sort_unique_bucket(
+                        &scratch_[bucket_start[b]],
+                        bucket_start[b + 1] - bucket_start[b],
+                        1);
+                }
+            });
+
+        for (int b = 0; b < kBuckets; ++b) {
+            for (size_t i = 0; i < unique[b]; ++i) {
+                emit(scratch_[bucket_start[b] + i]);
+            }
+        }
+    }
+
+private:
+    static const int kWidth = Key::width_bytes();
+    static const int kBuckets = 256;
+    // Buckets smaller than this are sorted with a comparison sort.
+    static const size_t kMinRadixSize = 64;
+    // Inputs smaller than this are not worth splitting up between
+    // threads.
+    static const size_t kMinParallelSize = 1 << 16;
+
+    // Returns the digit-th most significant byte of the key of pair.
+    uint8_t byte(const Pair& pair, int digit) const {
+        return pair.first.bytes()[order_[digit]];
+    }
+
+    // Sorts the n pairs starting from begin in place, assuming
+    // that they all share the same first _digit_ most significant
+    // bytes. Then removes the duplicates, moving the remaining
+    // pairs to the start of the range. Returns the number of
+    // remaining pairs.
+    size_t sort_unique_bucket(Pair* begin, size_t n, int digit) const {
+        sort_bucket(begin, n, digit);
+
+        size_t out = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if (out && begin[out - 1].first == begin[i].first) {
+                begin[out - 1].second = std::min(begin[out - 1].second,
+                                                 begin[i].second);
+            } else {
+                begin[out++] = begin[i];
+            }
+        }
+        return out;
+    }
+
+    // An in-place MSD radix sort (American flag sort) of the n
+    // pairs starting from begin, assuming that they all share the
+    // same first _digit_ most significant bytes.
+    void sort_bucket(Pair* begin, size_t n, int digit) const {
+        if (digit == kWidth) {
+            // All the keys are identical.
+            return;
+        }
+        if (n < kMinRadixSize) {
+            std::sort(begin, begin + n,
+                      [] (const Pair& a, const Pair& b) {
+                          return a.first < b.first;
+                      });
+            return;
+        }
+
+        size_t count[kBuckets] = { 0 };
+        for (size_t i = 0; i < n; ++i) {
+            ++count[byte(begin[i], digit)];
+        }
+
+        // Permute the pairs in place such that all pairs belonging to
+        // bucket b are between start[b] and end[b].
+        size_t start[kBuckets], next[kBuckets];
+        size_t at = 0;
+        for (int b = 0; b < kBuckets; ++b) {
+            start[b] = next[b] = at;
+            at += count[b];
+        }
+        for (int b = 0; b < kBuckets; ++b) {
+            size_t end = start[b] + count[b];
+            while (next[b] < end) {
+                Pair& pair = begin[next[b]];
+                int target = byte(pair, digit);
+                if (target == b) {
+                    ++next[b];
+                } else {
+                    std::swap(pair, begin[next[target]++]);
+                }
+            }
+        }
+
+        for (int b = 0; b < kBuckets; ++b) {
+            if (count[b] > 1) {
+                sort_bucket(begin + start[b], count[b], digit + 1);
+            }
+        }
+    }
+
+    // The byte indexes of the keys, from most significant to least
+    // significant.
+    int order_[kWidth];
+    // Temporary storage for the parallel distribution pass.
+    std::vector<Pair> scratch_;
+};
+
+#endif // RADIX_SORT_H
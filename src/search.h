@@ -50,10 +50,20 @@
 #define SEARCH_H
 
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
+#include <sys/stat.h>
+
+#include "bloom-filter.h"
+#include "checkpoint.h"
 #include "compress.h"
 #include "file-backed-array.h"
+#include "memory-budget.h"
+#include "radix-sort.h"
 
 // A default policy class, with hook implementations that do nothing.
 template<class State, class FixedState>
@@ -68,6 +78,62 @@ struct BFSPolicy {
     }
 };
 
+// Tuning knobs for BreadthFirstSearch. None of these affect the
+// result of the search, just how the work gets done.
+struct BFSOptions {
+    // The number of threads used for expanding the states of a
+    // depth.
+    int threads = 1;
+    // The number of background threads for compressing and writing
+    // out the sorted runs. If 0, the runs are compressed by the
+    // threads that produce them.
+    int compression_threads = 0;
+    // The number of background threads for decompressing the blocks
+    // of the sorted runs before they're needed. If 0, the blocks are
+    // decompressed by the threads that read them, when they read
+    // them.
+    int read_ahead_threads = 0;
+    // If 0, the set of seen states is stored as a single sorted run,
+    // which gets rewritten on every depth. Otherwise it's stored as
+    // a set of sorted runs, with each run being at least this many
+    // times larger than all the newer runs combined. (See SeenSet).
+    double seen_size_ratio = 0;
+    // The size of the Bloom filter used for detecting new states that
+    // have definitely not been seen before, in bytes. If 0, no filter
+    // is used. The filter counts against the memory budget.
+    size_t filter_bytes = 0;
+    // If not empty, the state of the search is checkpointed to this
+    // directory after every depth.
+    std::string checkpoint_dir;
+    // If true, and checkpoint_dir contains a checkpoint of a search
+    // of the same level, the search continues from the checkpoint.
+    bool resume = false;
+    // The settings for compressing the long-lived sorted runs
+    // (keys_by_depth and the seen set), which get read on every
+    // depth.
+    CompressorOptions compression;
+    // The settings for compressing the runs of new states, which
+    // are read just once.
+    CompressorOptions new_state_compression;
+    // The settings for reading the sorted runs.
+    DecompressorOptions decompression;
+    // If not 0, a zstd dictionary of at most this many bytes is
+    // trained from the blocks compressed on the first depths of the
+    // search, and used for compressing all later blocks.
+    size_t dictionary_bytes = 0;
+    // If true, benchmarks all the codecs on the keys of each depth.
+    bool codec_benchmark = false;
+    // The amount of memory to use for buffers, in bytes (see
+    // MemoryBudget). If 0, it's derived from the memory available
+    // to the process.
+    size_t memory_bytes = 0;
+    // The maximum number of sorted runs to merge at once. If there
+    // are more new runs than that on a depth, they're first merged
+    // together in several passes. If 0, it's derived from the memory
+    // budget.
+    int max_fan_in = 0;
+};
+
 // A breadth first search driven by the template parameters.
 //
 // Template parameters.
@@ -97,12 +163,13 @@ struct BFSPolicy {
 // - bytes(): Returns a mutable array of width_bytes() bytes.
 // - hash(): Returns a hash code.
 // - operator< and operator==: PackedStates must have a total order.
+// - significant_byte(i): Returns the index of the byte that is the
+//   i'th most significant one in the order defined by operator<.
 // - There must be mutual constructors from PackedState to State
 //   and vice versa.
 template<class State, class FixedState,
          class Policy = BFSPolicy<State, FixedState>,
-         class PackedState = typename State::Packed,
-         bool Compress = true>
+         class PackedState = typename State::Packed>
 class BreadthFirstSearch {
 public:
     // The serialized states are the main key type for our data structures.
@@ -123,18 +190,76 @@ public:
     // The keys / values collected during a single iteration of the
     // search.
     using NewStates = std::vector<st_pair>;
+    // The same, but split by whether the filter knows that the state
+    // has not been seen before.
+    struct NewStateBuffer {
+        // States that might have been seen before.
+        NewStates maybe_seen;
+        // States that have definitely not been seen before.
+        NewStates unseen;
+
+        size_t size() const {
+            return maybe_seen.size() + unseen.size();
+        }
+    };
     // A byte range point to a Keys array, indicating the start/end of
     // a sorted sequence of keys.
     using KeyRun = Keys::Run;
 
-    using KeyStream = StructureDeltaDecompressorStream<Key, Compress>;
+    using KeyStream = StructureDeltaDecompressorStream<Key>;
     using ValueStream = PointerStream<Value>;
     using KeyCompressor = ByteArrayDeltaCompressor<Key::width_bytes(),
-                                                   Compress,
-                                                   Keys>;
+                                                   Keys, Key>;
+
+    // The amount of samples to train a dictionary from, relative to
+    // the size of the dictionary.
+    static const size_t kDictionarySampleRatio = 50;
+    // The maximum amount of data to benchmark the codecs on.
+    static const size_t kCodecBenchmarkBytes = 64 << 20;
+    // The version of the checkpoint format. Needs to be changed
+    // whenever the format of the checkpoint or of the compressed
+    // runs changes.
+    static const uint64_t kCheckpointVersion = 3;
+
+    explicit BreadthFirstSearch(const BFSOptions& options = BFSOptions())
+        : options_(options),
+          budget_(options_.memory_bytes, options_.filter_bytes),
+          max_new_states_(budget_.new_state_bytes() / sizeof(st_pair)) {
+        if (options_.filter_bytes) {
+            filter_.reset(new BlockedBloomFilter(options_.filter_bytes));
+        }
+        if (options_.compression_threads) {
+            compression_pool_.reset(
+                new ThreadPool(options_.compression_threads));
+            options_.compression.pool = compression_pool_.get();
+            options_.new_state_compression.pool = compression_pool_.get();
+        }
+        if (options_.read_ahead_threads) {
+            read_ahead_pool_.reset(
+                new ThreadPool(options_.read_ahead_threads));
+            options_.decompression.pool = read_ahead_pool_.get();
+        }
+        if (options_.dictionary_bytes) {
+            sampler_.reset(new ZstdSampler(options_.dictionary_bytes *
+                                           kDictionarySampleRatio));
+            options_.compression.sampler = sampler_.get();
+            options_.new_state_compression.sampler = sampler_.get();
+        }
+    }
 
     // Execute a search from start_state to any win state.
     int search(State start_state, const FixedState& setup) {
+        std::vector<NewStates> layers(1);
+        layers[0].push_back(st_pair(start_state, 0));
+        return search(&layers, setup);
+    }
+
+    // Continue a search that has already been done up to some depth
+    // (e.g. by HashTableSearch). (*layers)[i] must contain the states
+    // first reached at depth i along with their values, in any order
+    // but without duplicates. The states in the last layer must not
+    // have been expanded yet. Consumes the contents of *layers.
+    int search(std::vector<NewStates>* layers, const FixedState& setup) {
         State null_state;
 
         // BFS state
@@ -143,42 +268,63 @@ public:
         // depth. Each state will be in keys_by_depth just once. The
         // new states generated from depth N in the search will be
         // in the Nth sorted run in the array.
-        Keys keys_by_depth;
+        Keys keys_by_depth(search_array_bytes());
         // The values associated to the states in keys_by_depth, in
         // the same order.
-        Values values_by_depth;
-        // The same keys as in all_keys, but in a single sorted run.
-        // This array gets recreated on every depth.
-        Keys all_keys;
+        Values values_by_depth(search_array_bytes());
+        // The same keys as in keys_by_depth, but in a small number
+        // of sorted runs.
+        SeenSet seen;
         // The winning state, if one has been found.
         st_pair win_state { null_state, 0 };
-        st_pair start_st { start_state, 0 };
+        // Identifies the level being searched, for checkpoints.
+        const Key& start_key = (*layers)[0][0].first;
+        std::vector<uint64_t> level_id { start_key.hash(),
+                                         Key::width_bytes() };
+        // The depth to start the search from.
+        int first_iter = layers->size() - 1;
 
-        // Initialize the data structures with the start state.
-        {
-            Keys::WriteRun key_writer { &keys_by_depth };
-            Values::WriteRun value_writer { &values_by_depth };
-
-            KeyCompressor compress { &keys_by_depth };
-            compress.pack(start_st.first.bytes());
-            values_by_depth.push_back(0);
+        printf("Memory budget: %ld MB\n", budget_.bytes() >> 20);
+        if (!options_.checkpoint_dir.empty()) {
+            mkdir(options_.checkpoint_dir.c_str(), 0755);
+        }
+        if (options_.resume &&
+            restore_checkpoint(level_id, &keys_by_depth, &values_by_depth,
+                               &seen, &first_iter)) {
+            printf("Resuming from depth %d\n", first_iter);
+            layers->clear();
         }
 
-        {
-            Keys::WriteRun key_writer { &all_keys };
-            KeyCompressor compress { &all_keys };
-            compress.pack(start_st.first.bytes());
+        // Initialize the data structures with the layers.
+        for (auto& layer : *layers) {
+            if (filter_) {
+                for (const auto& pair : layer) {
+                    filter_->insert(pair.first.hash());
+                }
+            }
+            size_t count = sort_pairs(&layer, &keys_by_depth,
+                                      &values_by_depth,
+                                      options_.compression,
+                                      options_.threads);
+            if (count) {
+                seen.emplace_back();
+                seen.back().depth_run = keys_by_depth.run_count() - 1;
+                seen.back().size = count;
+                if (options_.seen_size_ratio != 0) {
+                    compact(&seen, keys_by_depth);
+                }
+            }
+        }
+        if (options_.seen_size_ratio == 0 && seen.size() > 1) {
+            merge_seen_runs(&seen, keys_by_depth, 0);
         }
 
-        for (int iter = 0; ; ++iter) {
+        for (int iter = first_iter; ; ++iter) {
             Policy::start_iteration(iter);
 
             // The new states generated on this iteration, in some
             // number of sorted runs.
-            Keys new_keys;
-            // The values associated with the new states, in the same
-            // order as new_keys.
-            Values new_values;
+            NewRuns new_runs(new_state_array_bytes());
 
             // The latest run in keys_by_depth will contain all the
             // states we know about but have not yet visited.
@@ -188,25 +334,43 @@ public:
                 return 0;
             }
 
-            bool win = visit_states(setup, last_run, &new_keys, &new_values,
-                                    &win_state);
+            CompressionStats::get().reset();
+            bool win = visit_states(setup, last_run, &new_runs, &win_state);
+            io_ = IoStats();
 
-            printf("  new states: %ld\n", new_values.size());
+            printf("  new states: %ld\n", new_runs.values.size());
+            if (filter_) {
+                printf("  unseen by filter: %ld\n", new_runs.unseen_count);
+            }
             fflush(stdout);
 
             // Find all the new states that had never been generated
             // at an earlier depth. These states will be written out
             // to keys as a new run. All other new states will be
             // discarded.
-            int uniq = dedup(&keys_by_depth, &values_by_depth, &all_keys,
-                             new_keys, new_values);
+            int uniq = dedup(&keys_by_depth, &values_by_depth, &seen,
+                             new_runs);
             printf("  new unique: %d\n", uniq);
-            printf("  total size: %ld / %ld\n", all_keys.size(),
+            printf("  total size: %ld / %ld\n",
+                   seen_bytes(seen, keys_by_depth),
                    values_by_depth.size());
+            printf("  seen set: %ld runs, read %ld, written %ld bytes "
+                   "(%ld copied)\n",
+                   seen.size(), io_.read, io_.written, io_.copied);
+            print_compression_stats();
+            if (options_.codec_benchmark) {
+                benchmark_codecs(keys_by_depth);
+            }
+            maybe_train_dictionary();
 
             if (win) {
                 break;
             }
+
+            if (!options_.checkpoint_dir.empty()) {
+                write_checkpoint(level_id, iter + 1, &keys_by_depth,
+                                 &values_by_depth, &seen);
+            }
         }
 
         return trace_solution_path(setup, keys_by_depth, values_by_depth, win_state);
@@ -215,51 +379,183 @@ public:
 
 private:
 
+    // The states generated during a single iteration of the search,
+    // as some number of sorted runs.
+    struct NewRuns {
+        // Runs whose arrays buffer up to buffer_bytes bytes each in
+        // memory.
+        explicit NewRuns(size_t buffer_bytes)
+            : keys(buffer_bytes), values(buffer_bytes) {
+        }
+
+        Keys keys;
+        // The values associated with the states, in the same order
+        // as keys.
+        Values values;
+        // For each run, whether the states in that run are known to
+        // not have been seen before.
+        std::vector<char> unseen;
+        // The total number of states in runs marked as unseen.
+        size_t unseen_count = 0;
+    };
+
     // Visits all states in run. Writes the generated states into
-    // one or more runs of new_keys and new_values. If a winning
-    // state is found, sets it to win_state and returns true.
+    // one or more runs of new_runs. If a winning state is found,
+    // sets it to win_state and returns true.
     bool visit_states(const FixedState& setup, const KeyRun& run,
-                      Keys* new_keys, Values* new_values,
-                      st_pair* win_state) {
+                      NewRuns* new_runs, st_pair* win_state) {
+        // The run is split between threads at block boundaries. If
+        // the run is too small to be split, the threads are used just
+        // for sorting the output.
+        if (options_.threads > 1) {
+            // Use more parts than threads, so that the work stays
+            // evenly spread out even if some parts are slower to
+            // expand than others.
+            auto parts = split_compressed_blocks(run.first, run.second,
+                                                 options_.threads * 8);
+            if (parts.size() > 1) {
+                return visit_states_parallel(setup, parts, new_runs,
+                                             win_state);
+            }
+        }
+
         // A temporary collection of new states / values. Will
         // get flushed into new_keys / new_values either when
         // it grows too large or once we've dealt with the whole
         // todo queue.
-        NewStates new_states;
+        NewStateBuffer new_states;
         bool win = false;
 
-        // Visit all the states added on the last depth.
-        for (KeyStream todo(run.first, run.second); todo.next(); ) {
-            State st(todo.value());
-            auto parent_hash = todo.value().hash();
-
-            // For each state collect the possible output states.
-            st.do_valid_moves(setup,
-                              [&new_states, &parent_hash, &win_state,
-                               &win]
-                              (State new_state) {
-                                  st_pair pair(new_state,
-                                               parent_hash & 0xff);
-                                  new_states.push_back(pair);
-                                  if (new_state.win()) {
-                                      *win_state = pair;
-                                      win = true;
-                                      return true;
-                                  }
-                                  return false;
-                              });
-            // If we collect too many new states, do an
-            // intermediate deduplication + compression step now.
-            if (new_states.size() > 100000000) {
-                pack_pairs(&new_states, new_keys, new_values);
+        // Visit all the states added on the last depth, decoding
+        // them a batch at a time.
+        KeyStream todo(run.first, run.second, options_.decompression);
+        std::vector<Key> batch(stream_batch_size<Key>());
+        for (size_t n; (n = todo.next_batch(batch.data(), batch.size())); ) {
+            for (size_t i = 0; i < n; ++i) {
+                if (expand_state(setup, batch[i], &new_states, win_state)) {
+                    win = true;
+                }
+                // If we collect too many new states, do an
+                // intermediate deduplication + compression step now.
+                if (new_states.size() > max_new_states_) {
+                    pack_pairs(&new_states, new_runs, options_.threads);
+                }
             }
         }
         // Dedup + compression any leftovers.
-        pack_pairs(&new_states, new_keys, new_values);
+        pack_pairs(&new_states, new_runs, options_.threads);
 
         return win;
     }
 
+    // Like visit_states, but for a run that's been split into
+    // independently decodable parts. Visits the parts in
+    // options_.threads threads. Each thread collects the states it
+    // generates into its own buffer, and writes its own runs to
+    // new_runs.
+    //
+    // If multiple winning states are found, picks the one that
+    // visit_states would have picked (i.e. the last one in run order).
+    bool visit_states_parallel(const FixedState& setup,
+                               const std::vector<KeyRun>& parts,
+                               NewRuns* new_runs, st_pair* win_state) {
+        int threads = options_.threads;
+        // The last winning state found in each part, if any.
+        std::vector<st_pair> part_win(parts.size());
+        std::vector<char> part_won(parts.size());
+        std::atomic<size_t> next_part { 0 };
+        // Protects new_runs.
+        std::mutex output_mutex;
+
+        run_parallel(threads, [&] (int thread) {
+                NewStateBuffer new_states;
+
+                // Sorts + compresses the collected states into runs
+                // that are local to this thread, and then copies the
+                // runs to the shared output.
+                auto flush = [&] () {
+                    if (!new_states.size()) {
+                        return;
+                    }
+                    NewRuns runs(new_state_array_bytes());
+                    pack_pairs(&new_states, &runs, 1);
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    for (int i = 0; i < runs.keys.run_count(); ++i) {
+                        append_run(runs.keys.run(i), &new_runs->keys);
+                        append_run(runs.values.run(i), &new_runs->values);
+                        new_runs->unseen.push_back(runs.unseen[i]);
+                    }
+                    new_runs->unseen_count += runs.unseen_count;
+                };
+
+                std::vector<Key> batch(stream_batch_size<Key>());
+                for (size_t i; (i = next_part++) < parts.size(); ) {
+                    KeyStream todo(parts[i].first, parts[i].second,
+                                   options_.decompression);
+                    for (size_t n;
+                         (n = todo.next_batch(batch.data(), batch.size())); ) {
+                        for (size_t j = 0; j < n; ++j) {
+                            if (expand_state(setup, batch[j], &new_states,
+                                             &part_win[i])) {
+                                part_won[i] = true;
+                            }
+                            if (new_states.size() >
+                                max_new_states_ / threads) {
+                                flush();
+                            }
+                        }
+                    }
+                }
+                flush();
+            });
+
+        for (int i = parts.size() - 1; i >= 0; --i) {
+            if (part_won[i]) {
+                *win_state = part_win[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Collects all the states that can be reached from the state
+    // "key" into new_states, with the hash of "key" as the value.
+    // If a winning state is found, sets it to win_state and returns
+    // true without generating the rest of the states.
+    bool expand_state(const FixedState& setup, const Key& key,
+                      NewStateBuffer* new_states, st_pair* win_state) {
+        State st(key);
+        auto parent_hash = key.hash();
+        const BlockedBloomFilter* filter = filter_.get();
+
+        return st.do_valid_moves(setup,
+                                 [new_states, &parent_hash, win_state,
+                                  filter]
+                                 (State new_state) {
+                                     st_pair pair(new_state,
+                                                  parent_hash & 0xff);
+                                     if (filter &&
+                                         !filter->maybe_contains(
+                                             pair.first.hash())) {
+                                         new_states->unseen.push_back(pair);
+                                     } else {
+                                         new_states->maybe_seen.push_back(pair);
+                                     }
+                                     if (new_state.win()) {
+                                         *win_state = pair;
+                                         return true;
+                                     }
+                                     return false;
+                                 });
+    }
+
+    // Appends the byte range "from" to "to" as a new run.
+    template<class Array>
+    static void append_run(const typename Array::Run& from, Array* to) {
+        typename Array::WriteRun writer { to };
+        to->insert_back(from.first, from.second);
+    }
+
     // Works backwards from the winning state to the start state,
     // calling Policy::trace on each state. Note that this function
     // takes advantage of the original keys_by_depth having one run per
@@ -275,46 +571,70 @@ private:
         for (int i = depth - 1; i > 0; --i) {
             Policy::trace(setup, State(target.first), i);
 
+            // Work through all the states at a given depth. The
+            // blocks are scanned in parallel, and the parent found in
+            // the earliest block wins. Once a parent has been found,
+            // the blocks after it are skipped.
             auto runinfo = keys_by_depth.run(i - 1);
-            // Work through all the states at a given depth.
-            KeyStream stream(runinfo.first, runinfo.second);
-
-            bool found_next = false;
-            for (int j = 0; stream.next(); ++j) {
-                const auto& key = stream.value();
-                st_pair current(key, 0);
-
-                // Look for states whose hash matches the value of
-                // the current states. (Since we've stored the hash
-                // of each state's parent in the value). This allows
-                // us to skip the full expensive test for all but
-                // one in 256 states.
-                if ((key.hash() & 0xff) != (target.second & 0xff)) {
-                    continue;
-                }
+            const Value* values = values_by_depth.run(i - 1).first;
+            BlockIndex<Key> index(runinfo.first, runinfo.second);
+            const auto& blocks = index.blocks();
+            std::atomic<size_t> next_block { 0 };
+            size_t found_block = blocks.size();
+            st_pair next_target;
+            std::mutex mutex;
 
-                // If the hashes matched, this is a potential parent
-                // of the current state. Try generating the output
-                // states for the potential parent, and check if any
-                // of them match the current one.
-                State st(key);
-                if (st.do_valid_moves(setup,
-                                      [&target](State new_state) {
-                                          Key p(new_state);
-                                          if (p == target.first) {
-                                              return true;
-                                          }
-                                          return false;
-                                      })) {
-                    // Got a match; set the potential parent as the
-                    // current state.
-                    const auto& value = values_by_depth.run(i - 1).first[j];
-                    target = st_pair(key, value);
-                    found_next = true;
-                    break;
-                }
-            }
-            assert(found_next);
+            run_parallel(options_.threads, [&] (int thread) {
+                    for (size_t b; (b = next_block++) < blocks.size(); ) {
+                        {
+                            std::lock_guard<std::mutex> lock(mutex);
+                            if (b > found_block) {
+                                return;
+                            }
+                        }
+                        const auto& block = blocks[b];
+                        KeyStream stream(block.begin, index.block_end(block));
+                        for (size_t j = block.records_before; stream.next();
+                             ++j) {
+                            const auto& key = stream.value();
+
+                            // Look for states whose hash matches the
+                            // value of the current states. (Since
+                            // we've stored the hash of each state's
+                            // parent in the value). This allows us to
+                            // skip the full expensive test for all
+                            // but one in 256 states.
+                            if ((key.hash() & 0xff) !=
+                                (target.second & 0xff)) {
+                                continue;
+                            }
+
+                            // If the hashes matched, this is a
+                            // potential parent of the current state.
+                            // Try generating the output states for
+                            // the potential parent, and check if any
+                            // of them match the current one.
+                            State st(key);
+                            if (st.do_valid_moves(
+                                    setup,
+                                    [&target](State new_state) {
+                                        Key p(new_state);
+                                        return p == target.first;
+                                    })) {
+                                std::lock_guard<std::mutex> lock(mutex);
+                                if (b < found_block) {
+                                    found_block = b;
+                                    next_target = st_pair(key, values[j]);
+                                }
+                                break;
+                            }
+                        }
+                    }
+                });
+
+            assert(found_block < blocks.size());
+            // Got a match; set the parent as the current state.
+            target = next_target;
         }
         Policy::trace(setup, State(target.first), 0);
 
@@ -324,122 +644,1129 @@ private:
     // Given a vector of newly generated states+value pairs,
     // deduplicates the states against other states in the same
     // vector. If there are multiple pairs with identical states
-    // but different values, keeps an arbitrary pair.
+    // but different values, keeps the pair with the smallest value.
+    // (Any choice would be valid, but a deterministic one makes the
+    // output independent of how the states were split into runs).
     //
-    // Writes the states (in sorted order) to new_keys.
-    // Writes the values (in the same order as the states) to new_values.
-    void pack_pairs(NewStates* new_states, Keys* new_keys,
-                    Values* new_values) {
-        std::sort(new_states->begin(), new_states->end(),
-                  [] (const st_pair& a, const st_pair& b) {
-                      return a.first < b.first;
-                  });
-        Key prev;
-
-        Keys::WriteRun key_writer { new_keys };
-        Values::WriteRun value_writer { new_values };
-        KeyCompressor compress { new_keys };
-        for (const auto& pair : *new_states) {
-            if (pair.first == prev) {
-                continue;
-            }
-            compress.pack(pair.first.bytes());
-            new_values->push_back(pair.second);
-            prev = pair.first;
+    // Writes the states (in sorted order) to a new run of
+    // new_runs->keys, and the values (in the same order as the
+    // states) to new_runs->values. The states that might have been
+    // seen before and the ones that definitely have not are written
+    // to separate runs.
+    //
+    // The sorting is done using up to _threads_ threads.
+    void pack_pairs(NewStateBuffer* new_states, NewRuns* new_runs,
+                    int threads) {
+        pack_pairs(&new_states->maybe_seen, false, new_runs, threads);
+        pack_pairs(&new_states->unseen, true, new_runs, threads);
+    }
+
+    void pack_pairs(NewStates* new_states, bool unseen, NewRuns* new_runs,
+                    int threads) {
+        if (new_states->empty()) {
+            return;
         }
 
+        size_t count = sort_pairs(new_states, &new_runs->keys,
+                                  &new_runs->values,
+                                  options_.new_state_compression, threads);
+        new_runs->unseen.push_back(unseen);
+        if (unseen) {
+            new_runs->unseen_count += count;
+        }
+    }
+
+    // Sorts and deduplicates new_states like pack_pairs, and writes
+    // them to a new run of keys and values, compressing the keys
+    // with the given settings. Returns the number of unique states.
+    size_t sort_pairs(NewStates* new_states, Keys* keys, Values* values,
+                      const CompressorOptions& compression, int threads) {
+        Keys::WriteRun key_writer { keys };
+        Values::WriteRun value_writer { values };
+        KeyCompressor compress { keys, compression };
+
+        size_t count = 0;
+        PairRadixSorter<Key, Value> sorter;
+        sorter.sort_unique(new_states, threads,
+                           [&compress, values, &count]
+                           (const st_pair& pair) {
+                               compress.pack(pair.first.bytes());
+                               values->push_back(pair.second);
+                               ++count;
+                           });
+
         new_states->clear();
+        return count;
     }
 
-    // Finds all states in new_keys that are not present in
-    // all_keys. Adds them to keys_by_depth as a new run. Rewrites
-    // all_keys to be a single run that's a union of new_keys
-    // and the original all_keys.
+    // A sorted run of the seen set.
+    struct SeenRun {
+        // The run of keys_by_depth that contains the states of this
+        // run, or -1 if they're stored in "keys" instead.
+        int depth_run = -1;
+        std::unique_ptr<Keys> keys;
+        // The number of states in the run.
+        size_t size = 0;
+        // If the run is stored in "keys" and the search is being
+        // checkpointed, the id of the checkpoint file backing "keys".
+        int file_id = -1;
+    };
+    // The set of all states seen so far, as a collection of disjoint
+    // sorted runs from the oldest to the newest.
     //
-    // Returns the number of states added to all_keys.
+    // If options_.seen_size_ratio is 0, the seen set is kept as a
+    // single run, which is rewritten on every depth as part of dedup.
+    // Otherwise it's organized like a size-tiered LSM tree: the
+    // new unique states of each depth (i.e. the run just added to
+    // keys_by_depth) become a new run of the seen set, and runs
+    // are merged together only when they would otherwise be too
+    // small compared to the runs newer than them. This means that
+    // most states are rewritten only a few times over the whole
+    // search, rather than on every depth.
+    using SeenSet = std::vector<SeenRun>;
+
+    // The amount of data read and written while deduplicating states.
+    struct IoStats {
+        size_t read = 0;
+        size_t written = 0;
+        // The part of "written" that was copied from the seen set
+        // without decompressing it.
+        size_t copied = 0;
+    };
+
+    // Returns the byte range containing the states of a seen run.
+    static KeyRun seen_run(const SeenRun& run, const Keys& keys_by_depth) {
+        if (run.keys) {
+            return KeyRun(run.keys->begin(), run.keys->end());
+        }
+        return keys_by_depth.run(run.depth_run);
+    }
+
+    // Returns the total size of the seen set in bytes.
+    static size_t seen_bytes(const SeenSet& seen, const Keys& keys_by_depth) {
+        size_t bytes = 0;
+        for (const auto& run : seen) {
+            auto range = seen_run(run, keys_by_depth);
+            bytes += std::distance(range.first, range.second);
+        }
+        return bytes;
+    }
+
+    // Finds all states in new_runs that are not present in the seen
+    // set. Adds them to keys_by_depth as a new run, and to the
+    // seen set.
+    //
+    // Returns the number of states added to the seen set.
     size_t dedup(Keys* keys_by_depth, Values* values_by_depth,
-                 Keys* all_keys,
-                 const Keys& new_keys, const Values &new_values) {
-        // Set to true iff a state should be discarded due to the
-        // presence of an earlier duplicate.
-        std::vector<bool> discard(new_values.size());
-        Keys new_all_keys;
-
-        using PairStream = StreamPairer<Key, Value, KeyStream, ValueStream>;
-
-        // Iterate through the new keys / values in tandem. If new_*
-        // has multiple runs, interleave the runs togehter into a
-        // single sorted stream.
-        SortedStreamInterleaver<typename PairStream::Pair, PairStream>
-            new_stream;
-        for (int run = 0; run < new_keys.run_count(); ++run) {
-            auto keyinfo = new_keys.run(run);
-            auto valinfo = new_values.run(run);
-            if (keyinfo.first != keyinfo.second) {
-                auto keystream =
-                    new KeyStream(keyinfo.first, keyinfo.second);
-                auto valstream =
-                    new ValueStream(valinfo.first, valinfo.second);
-                new_stream.add_stream(new PairStream(keystream,
-                                                     valstream));
+                 SeenSet* seen, const NewRuns& new_runs) {
+        std::vector<PairRun> pair_runs;
+        for (int run = 0; run < new_runs.keys.run_count(); ++run) {
+            PairRun pair_run;
+            pair_run.keys = new_runs.keys.run(run);
+            pair_run.values = new_runs.values.run(run);
+            pair_run.unseen = new_runs.unseen[run];
+            if (pair_run.keys.first != pair_run.keys.second) {
+                pair_runs.push_back(pair_run);
             }
         }
+        std::vector<KeyRun> seen_runs;
+        for (const auto& run : *seen) {
+            seen_runs.push_back(seen_run(run, *keys_by_depth));
+        }
+        std::vector<std::unique_ptr<NewRuns>> passes;
+        reduce_fan_in(&pair_runs, seen_runs.size(), &passes);
 
-        {
-            Keys::WriteRun key_writer { keys_by_depth };
-            Values::WriteRun value_writer { values_by_depth };
-            Keys::WriteRun all_keys_writer { &new_all_keys };
+        MergeOutput out;
+        out.unique = keys_by_depth;
+        out.values = values_by_depth;
+        out.filter = filter_.get();
+        SeenRun merged;
+        if (options_.seen_size_ratio == 0) {
+            // Rewrite the whole seen set as a single run as part
+            // of the same merge.
+            create_seen_keys(&merged);
+            out.merged = merged.keys.get();
+        }
+        // The seen set can contain runs of keys_by_depth, which must
+        // not be appended to while they're being read. So the new
+        // keys are then first written to a separate array.
+        Keys unique(search_array_bytes());
+        for (const auto& run : *seen) {
+            if (run.depth_run >= 0) {
+                out.unique = &unique;
+            }
+        }
+        merge_runs(pair_runs, seen_runs, out);
+        if (out.unique == &unique) {
+            append_run(unique.run(0), keys_by_depth);
+        }
+
+        auto last_run = values_by_depth->run(values_by_depth->run_count() - 1);
+        size_t count = std::distance(last_run.first, last_run.second);
+
+        if (merged.keys) {
+            for (const auto& run : *seen) {
+                merged.size += run.size;
+            }
+            merged.size += count;
+            seen->clear();
+            seen->push_back(std::move(merged));
+        } else if (count) {
+            SeenRun run;
+            run.depth_run = keys_by_depth->run_count() - 1;
+            run.size = count;
+            seen->push_back(std::move(run));
+            compact(seen, *keys_by_depth);
+        }
+
+        return count;
+    }
+
+    // Merges the newest runs of the seen set together, such that
+    // each run is at least options_.seen_size_ratio times larger
+    // than all of the newer runs combined.
+    void compact(SeenSet* seen, const Keys& keys_by_depth) {
+        int first = seen->size() - 1;
+        size_t newer = seen->back().size;
+        while (first > 0 &&
+               (*seen)[first - 1].size < options_.seen_size_ratio * newer) {
+            --first;
+            newer += (*seen)[first].size;
+        }
+        if (first == seen->size() - 1) {
+            return;
+        }
+        merge_seen_runs(seen, keys_by_depth, first);
+    }
+
+    // Merges the runs of the seen set starting from "first" into a
+    // single run.
+    void merge_seen_runs(SeenSet* seen, const Keys& keys_by_depth,
+                         int first) {
+        std::vector<KeyRun> runs;
+        SeenRun merged;
+        for (int i = first; i < seen->size(); ++i) {
+            runs.push_back(seen_run((*seen)[i], keys_by_depth));
+            merged.size += (*seen)[i].size;
+        }
+        create_seen_keys(&merged);
+        MergeOutput out;
+        out.merged = merged.keys.get();
+        merge_runs(std::vector<PairRun>(), runs, out);
+
+        seen->resize(first);
+        seen->push_back(std::move(merged));
+    }
+
+    // The array buffer part of the memory budget is split evenly
+    // between groups of arrays that can all be alive at the same
+    // time, and each group divides its part between its arrays:
+    //
+    // - The arrays of the search itself: keys_by_depth,
+    //   values_by_depth, the new keys written by dedup(), the seen
+    //   run being written, and the older seen runs. The older runs
+    //   only hold memory while they're too small to have been spilled
+    //   to disk, and get the part of two arrays between them.
+    // - The runs of new states of a depth, written by the expansion
+    //   threads, and the merge passes over them.
+    // - The outputs of the key ranges of a merge.
+    static const int kArrayGroups = 3;
+    static const int kSearchArrays = 6;
+
+    // The buffer size for each of _arrays_ arrays of one group.
+    size_t array_buffer_bytes(size_t arrays) const {
+        return MemoryBudget::split_array_buffers(
+            budget_.array_buffer_bytes() / kArrayGroups, arrays);
+    }
 
-            KeyStream merged_stream { all_keys->begin(),
-                    all_keys->end() };
+    // The buffer size for the arrays of the search itself.
+    size_t search_array_bytes() const {
+        return array_buffer_bytes(kSearchArrays);
+    }
+
+    // The buffer size for the arrays of the new runs of a depth: the
+    // runs of the depth, and the runs each expansion thread is
+    // writing.
+    size_t new_state_array_bytes() const {
+        return array_buffer_bytes(2 + 2 * options_.threads);
+    }
+
+    // Creates the array for the states of a new seen run. When
+    // checkpointing, the array is backed by the run's checkpoint file
+    // from the start, so that the run doesn't need to be written out
+    // a second time for the checkpoint.
+    void create_seen_keys(SeenRun* run) {
+        run->keys.reset(new Keys(search_array_bytes()));
+        if (!options_.checkpoint_dir.empty()) {
+            run->file_id = next_file_id_++;
+            run->keys->create(seen_file(run->file_id));
+            seen_file_ids_.push_back(run->file_id);
+        }
+    }
+
+    // Trains the compression dictionary once enough samples have been
+    // collected for it.
+    void maybe_train_dictionary() {
+        if (!sampler_ || !sampler_->full()) {
+            return;
+        }
+        set_dictionary(ZstdDictionary::train(*sampler_,
+                                             options_.dictionary_bytes,
+                                             options_.compression.level));
+        if (dictionary_) {
+            printf("  trained a %ld byte zstd dictionary\n",
+                   dictionary_->data().size());
+        } else {
+            printf("  failed to train a zstd dictionary\n");
+        }
+    }
+
+    // Starts using dictionary for compressing all new blocks, and
+    // stops collecting samples.
+    void set_dictionary(std::unique_ptr<ZstdDictionary> dictionary) {
+        dictionary_ = std::move(dictionary);
+        options_.compression.dictionary = dictionary_.get();
+        options_.compression.sampler = NULL;
+        options_.new_state_compression.dictionary = dictionary_.get();
+        options_.new_state_compression.sampler = NULL;
+        sampler_.reset();
+    }
+
+    static void print_compression_stats() {
+        const auto& stats = CompressionStats::get();
+        printf("  compressed %ld -> %ld bytes in %.3fs, "
+               "decompressed %ld -> %ld bytes in %.3fs\n",
+               (size_t) stats.compress_in_bytes,
+               (size_t) stats.compress_out_bytes,
+               stats.compress_ns / 1e9,
+               (size_t) stats.decompress_in_bytes,
+               (size_t) stats.decompress_out_bytes,
+               stats.decompress_ns / 1e9);
+    }
+
+    // Measures how well each codec would do on the keys of the
+    // latest depth.
+    static void benchmark_codecs(const Keys& keys_by_depth) {
+        std::vector<CompressorOptions> codecs;
+        for (const char* spec : { "none", "lz4", "zstd:-5", "zstd:1",
+                    "zstd:3", "zstd:9", "zstd:19", "zstd-long:3",
+                    "zstd-long:19" }) {
+            codecs.emplace_back();
+            parse_block_codec(spec, &codecs.back());
+        }
+        auto run = keys_by_depth.run(keys_by_depth.run_count() - 1);
+        benchmark_block_codecs(run.first, run.second, codecs,
+                               kCodecBenchmarkBytes);
+    }
+
+    // Checkpoints:
+    //
+    // A checkpoint consists of the following files in
+    // options_.checkpoint_dir:
+    //
+    // - keys_by_depth, values_by_depth: The contents of the arrays.
+    //   These are only ever appended to, so after the first
+    //   checkpoint only the new runs get written out.
+    // - seen-N: The runs of the seen set that are not part of
+    //   keys_by_depth. Each of these is written just once, directly
+    //   by the merge that produces the run (see create_seen_keys()).
+    // - dictionary: The zstd dictionary, if one has been trained.
+    // - manifest: The iteration to continue from, the sizes and
+    //   run boundaries of the arrays, and the structure of the seen
+    //   set. The checkpoint becomes valid only once the manifest has
+    //   been replaced, so a search that gets killed in the middle of
+    //   writing a checkpoint can be resumed from the previous one.
+
+    std::string checkpoint_path(const std::string& name) const {
+        return options_.checkpoint_dir + "/" + name;
+    }
+
+    // Writes a checkpoint of the search state at the start of the
+    // given iteration.
+    void write_checkpoint(const std::vector<uint64_t>& level_id,
+                          int iteration,
+                          Keys* keys_by_depth, Values* values_by_depth,
+                          SeenSet* seen) {
+        CheckpointManifest manifest;
+        manifest.add("version", { (uint64_t) kCheckpointVersion });
+        manifest.add("level", level_id);
+        manifest.add("iteration", { (uint64_t) iteration });
+
+        keys_by_depth->persist(checkpoint_path("keys_by_depth"));
+        add_array(&manifest, "keys_by_depth", *keys_by_depth);
+        values_by_depth->persist(checkpoint_path("values_by_depth"));
+        add_array(&manifest, "values_by_depth", *values_by_depth);
+
+        if (dictionary_) {
+            if (!dictionary_written_) {
+                write_file(checkpoint_path("dictionary"),
+                           dictionary_->data());
+                dictionary_written_ = true;
+            }
+            manifest.add("dictionary", { dictionary_->id() });
+        }
 
-            KeyCompressor compress { keys_by_depth };
-            KeyCompressor compress_merged { &new_all_keys };
+        std::vector<int> file_ids;
+        for (auto& run : *seen) {
+            if (!run.keys) {
+                manifest.add("seen_depth_run",
+                             { (uint64_t) run.depth_run, run.size });
+                continue;
+            }
+            // The run was created in its checkpoint file, so this
+            // just syncs it.
+            run.keys->persist(seen_file(run.file_id));
+            manifest.add("seen_file",
+                         { (uint64_t) run.file_id, run.size,
+                           run.keys->size() });
+            file_ids.push_back(run.file_id);
+        }
 
-            merged_stream.next();
+        manifest.write(checkpoint_path("manifest"));
+
+        // The seen set files that are not referenced by the new
+        // checkpoint are no longer needed. (Either they were only
+        // referenced by the previous one, or their runs were merged
+        // away before ever being checkpointed).
+        for (int id : seen_file_ids_) {
+            if (std::find(file_ids.begin(), file_ids.end(), id) ==
+                file_ids.end()) {
+                unlink(seen_file(id).c_str());
+            }
+        }
+        seen_file_ids_ = file_ids;
+    }
+
+    // Restores the search state from the checkpoint in
+    // options_.checkpoint_dir. Returns false if there's no valid
+    // checkpoint. Aborts if the checkpoint is for a different level,
+    // or for states encoded differently.
+    bool restore_checkpoint(const std::vector<uint64_t>& level_id,
+                            Keys* keys_by_depth, Values* values_by_depth,
+                            SeenSet* seen, int* iteration) {
+        CheckpointManifest manifest;
+        if (!manifest.read(checkpoint_path("manifest"))) {
+            printf("No checkpoint found in %s, starting from scratch\n",
+                   options_.checkpoint_dir.c_str());
+            return false;
+        }
+        const auto* version = manifest.find("version");
+        if (!version || version->values.empty() ||
+            version->values[0] != kCheckpointVersion) {
+            fprintf(stderr, "%s: unsupported checkpoint version\n",
+                    options_.checkpoint_dir.c_str());
+            abort();
+        }
+        // The level id is derived from the encoded start state, so
+        // it also changes if the state encoding does.
+        const auto* level = manifest.find("level");
+        if (!level || level->values != level_id) {
+            fprintf(stderr, "%s: the level or the state encoding of the "
+                    "checkpoint does not match\n",
+                    options_.checkpoint_dir.c_str());
+            abort();
+        }
+
+        *iteration = manifest.find("iteration")->values[0];
+        // The dictionary has to be loaded before anything gets
+        // decompressed.
+        if (manifest.find("dictionary")) {
+            std::vector<uint8_t> data;
+            read_file(checkpoint_path("dictionary"), &data);
+            set_dictionary(std::unique_ptr<ZstdDictionary>(
+                new ZstdDictionary(data, options_.compression.level)));
+            assert(dictionary_->id() ==
+                   manifest.find("dictionary")->values[0]);
+            dictionary_written_ = true;
+        }
+        restore_array(manifest, "keys_by_depth", keys_by_depth);
+        restore_array(manifest, "values_by_depth", values_by_depth);
+
+        for (const auto& record : manifest.records()) {
+            if (record.name == "seen_depth_run") {
+                seen->emplace_back();
+                seen->back().depth_run = record.values[0];
+                seen->back().size = record.values[1];
+            } else if (record.name == "seen_file") {
+                seen->emplace_back();
+                auto& run = seen->back();
+                run.file_id = record.values[0];
+                run.size = record.values[1];
+                run.keys.reset(new Keys(search_array_bytes()));
+                run.keys->restore(seen_file(run.file_id), record.values[2],
+                                  { 0 }, { record.values[2] });
+                seen_file_ids_.push_back(run.file_id);
+                next_file_id_ = std::max(next_file_id_, run.file_id + 1);
+            }
+        }
+
+        if (filter_) {
+            for (const auto& run : keys_by_depth->runs()) {
+                for (KeyStream stream(run.first, run.second);
+                     stream.next(); ) {
+                    filter_->insert(stream.value().hash());
+                }
+            }
+        }
+
+        return true;
+    }
+
+    static void write_file(const std::string& path,
+                           const std::vector<uint8_t>& data) {
+        FILE* file = fopen(path.c_str(), "w");
+        if (!file ||
+            fwrite(&data[0], 1, data.size(), file) != data.size() ||
+            fflush(file) != 0 ||
+            fsync(fileno(file)) != 0) {
+            perror(path.c_str());
+            abort();
+        }
+        fclose(file);
+    }
+
+    static void read_file(const std::string& path,
+                          std::vector<uint8_t>* data) {
+        FILE* file = fopen(path.c_str(), "r");
+        if (!file) {
+            perror(path.c_str());
+            abort();
+        }
+        uint8_t buffer[4096];
+        for (size_t len; (len = fread(buffer, 1, sizeof(buffer), file)); ) {
+            data->insert(data->end(), buffer, buffer + len);
+        }
+        fclose(file);
+    }
+
+    std::string seen_file(int id) const {
+        return checkpoint_path("seen-" + std::to_string(id));
+    }
+
+    // Records the size and the run boundaries of array in manifest.
+    template<class Array>
+    static void add_array(CheckpointManifest* manifest,
+                          const std::string& name, const Array& array) {
+        manifest->add(name, { array.size() });
+        std::vector<uint64_t> starts(array.run_starts().begin(),
+                                     array.run_starts().end());
+        manifest->add(name + "_run_starts", starts);
+        std::vector<uint64_t> ends(array.run_ends().begin(),
+                                   array.run_ends().end());
+        manifest->add(name + "_run_ends", ends);
+    }
+
+    // Restores an array recorded in the manifest with add_array.
+    template<class Array>
+    void restore_array(const CheckpointManifest& manifest,
+                       const std::string& name, Array* array) const {
+        const auto& starts = manifest.find(name + "_run_starts")->values;
+        const auto& ends = manifest.find(name + "_run_ends")->values;
+        array->restore(checkpoint_path(name),
+                       manifest.find(name)->values[0],
+                       std::vector<size_t>(starts.begin(), starts.end()),
+                       std::vector<size_t>(ends.begin(), ends.end()));
+    }
+
+    using PairStream = StreamPairer<Key, Value, KeyStream, ValueStream>;
+    // Orders the streams of a merge by the most significant bytes of
+    // their keys.
+    struct MergePrefix {
+        static uint64_t get(const Key& key) {
+            return KeyPrefix<Key>::get(key);
+        }
+        static uint64_t get(const typename PairStream::Pair& pair) {
+            return KeyPrefix<Key>::get(pair.first);
+        }
+    };
+    using PairInterleaver =
+        SortedStreamInterleaver<typename PairStream::Pair, PairStream,
+                                true, MergePrefix>;
+    using KeyInterleaver =
+        SortedStreamInterleaver<Key, KeyStream, true, MergePrefix>;
+
+    // A sorted run of keys, and the run of their values.
+    struct PairRun {
+        KeyRun keys;
+        Values::Run values;
+        // If true, none of the keys are present in the seen runs.
+        bool unseen = false;
+    };
+
+    // The arrays that merge_runs() writes its output to. Any of them
+    // can be NULL, if the output isn't needed.
+    struct MergeOutput {
+        // The states that are only present in the new runs.
+        Keys* unique = NULL;
+        // The values of the states in "unique".
+        Values* values = NULL;
+        // All the states.
+        Keys* merged = NULL;
+        // A filter to add the states in "unique" to.
+        BlockedBloomFilter* filter = NULL;
+        // The settings for compressing "unique", or NULL for
+        // options_.compression.
+        const CompressorOptions* compression = NULL;
+    };
+
+    // Merges the sorted runs new_runs against the sorted and disjoint
+    // runs seen_runs. Writes the outputs described in MergeOutput to
+    // "out" as a single new run in each array.
+    //
+    // If using multiple threads, splits the key space into
+    // options_.threads ranges, and merges the ranges in parallel.
+    // The split points are sampled from the first keys of the
+    // compressed blocks of the input runs. Each range is written
+    // to separate outputs, and the outputs are concatenated into
+    // a single run at the end. (This works since each compressed
+    // block can be decoded independently).
+    void merge_runs(const std::vector<PairRun>& new_runs,
+                    const std::vector<KeyRun>& seen_runs,
+                    const MergeOutput& out) {
+        for (const auto& run : new_runs) {
+            io_.read += std::distance(run.keys.first, run.keys.second) +
+                std::distance(run.values.first, run.values.second);
+        }
+        for (const auto& run : seen_runs) {
+            io_.read += std::distance(run.first, run.second);
+        }
+
+        int threads = options_.threads;
+        DecompressorOptions decompression = merge_decompression(
+            threads * (new_runs.size() + seen_runs.size()));
+        if (threads <= 1) {
+            merge_range(NULL, NULL, new_runs, NULL, seen_runs, NULL, out,
+                        decompression);
+            return;
+        }
+
+        // Index the blocks of all the input runs, so that the
+        // merge of each range can start from the right block.
+        std::vector<BlockIndex<Key>> new_indexes;
+        for (const auto& run : new_runs) {
+            new_indexes.emplace_back(run.keys.first, run.keys.second);
+        }
+        std::vector<BlockIndex<Key>> seen_indexes;
+        for (const auto& run : seen_runs) {
+            seen_indexes.emplace_back(run.first, run.second);
+        }
+
+        // Each block is roughly the same size, so picking the split
+        // points evenly from the block fences will also split the
+        // work evenly.
+        std::vector<Key> fences;
+        for (const auto& index : new_indexes) {
+            for (const auto& block : index.blocks()) {
+                fences.push_back(block.first);
+            }
+        }
+        for (const auto& index : seen_indexes) {
+            for (const auto& block : index.blocks()) {
+                fences.push_back(block.first);
+            }
+        }
+        if (fences.empty()) {
+            merge_range(NULL, NULL, new_runs, NULL, seen_runs, NULL, out,
+                        decompression);
+            return;
+        }
+        std::sort(fences.begin(), fences.end());
+        std::vector<Key> splits;
+        for (int i = 1; i < threads; ++i) {
+            const Key& split = fences[i * fences.size() / threads];
+            if (i > 1 && split == splits.back()) {
+                continue;
+            }
+            splits.push_back(split);
+        }
+
+        struct RangeOutput {
+            Keys unique;
+            Values values;
+            Keys merged;
+        };
+        int ranges = splits.size() + 1;
+        std::vector<RangeOutput> outputs(ranges);
+        size_t buffer_bytes = array_buffer_bytes(
+            ranges * ((out.unique ? 2 : 0) + (out.merged ? 1 : 0)));
+        for (auto& range_out : outputs) {
+            range_out.unique.set_buffer_bytes(buffer_bytes);
+            range_out.values.set_buffer_bytes(buffer_bytes);
+            range_out.merged.set_buffer_bytes(buffer_bytes);
+        }
+        std::atomic<int> next_range { 0 };
+
+        run_parallel(threads, [&] (int thread) {
+                for (int r; (r = next_range++) < ranges; ) {
+                    MergeOutput range_out;
+                    if (out.unique) {
+                        range_out.unique = &outputs[r].unique;
+                        range_out.values = &outputs[r].values;
+                    }
+                    if (out.merged) {
+                        range_out.merged = &outputs[r].merged;
+                    }
+                    range_out.filter = out.filter;
+                    merge_range(r > 0 ? &splits[r - 1] : NULL,
+                                r < ranges - 1 ? &splits[r] : NULL,
+                                new_runs, &new_indexes,
+                                seen_runs, &seen_indexes,
+                                range_out, decompression);
+                }
+            });
+
+        OptionalWriteRun<Keys> unique_writer(out.unique);
+        OptionalWriteRun<Values> value_writer(out.values);
+        OptionalWriteRun<Keys> merged_writer(out.merged);
+        for (const auto& range_out : outputs) {
+            if (out.unique) {
+                out.unique->insert_back(range_out.unique.begin(),
+                                        range_out.unique.end());
+                out.values->insert_back(range_out.values.begin(),
+                                        range_out.values.end());
+            }
+            if (out.merged) {
+                out.merged->insert_back(range_out.merged.begin(),
+                                        range_out.merged.end());
+            }
+        }
+    }
+
+    // The largest block size of any of the sorted runs.
+    size_t max_block_bytes() const {
+        return std::max(options_.compression.block_size,
+                        options_.new_state_compression.block_size);
+    }
+
+    // The size of the batches of records that a merge reads at once
+    // from each of its sorted runs: the batch of pairs, and the
+    // batches of keys and values they're paired up from.
+    static size_t merge_batch_bytes() {
+        using Pair = typename PairStream::Pair;
+        return stream_batch_size<Pair>() *
+            (sizeof(Pair) + sizeof(Key) + sizeof(Value));
+    }
+
+    // The maximum number of sorted runs to merge at once. Each run
+    // being read holds a compressed and a decompressed block, and a
+    // batch of records, on each thread.
+    size_t max_fan_in() const {
+        if (options_.max_fan_in) {
+            return std::max(2, options_.max_fan_in);
+        }
+        size_t stream_bytes = 2 * max_block_bytes() + merge_batch_bytes();
+        return std::max<size_t>(2, budget_.read_bytes() /
+                                (stream_bytes * options_.threads));
+    }
+
+    // If merging new_runs against seen_runs seen runs would read more
+    // than max_fan_in() runs at once, merges the new runs together in
+    // groups of at most max_fan_in() runs, over as many passes as
+    // needed. Like in merge_runs(), duplicate states are dropped,
+    // keeping the one with the smallest value. The runs of states
+    // known to be unseen are only merged with each other. The merged
+    // runs are stored in *passes.
+    void reduce_fan_in(std::vector<PairRun>* new_runs, size_t seen_runs,
+                       std::vector<std::unique_ptr<NewRuns>>* passes) {
+        size_t fan_in = max_fan_in();
+        size_t max_new_runs = fan_in > seen_runs + 2 ? fan_in - seen_runs : 2;
+        size_t initial_runs = new_runs->size();
+        int pass_count = 0;
+
+        while (new_runs->size() > max_new_runs) {
+            // The earlier passes that are still alive share the
+            // buffers with this one and the original new runs.
+            std::unique_ptr<NewRuns> pass(new NewRuns(array_buffer_bytes(
+                2 * (passes->size() + 2))));
+            std::vector<PairRun> next;
+            for (bool unseen : { false, true }) {
+                std::vector<PairRun> group;
+                for (const auto& run : *new_runs) {
+                    if (run.unseen == unseen) {
+                        group.push_back(run);
+                    }
+                }
+                // Split the group evenly into as few chunks as
+                // possible.
+                size_t chunks = (group.size() + fan_in - 1) / fan_in;
+                for (size_t i = 0; i < chunks; ++i) {
+                    std::vector<PairRun> chunk(
+                        group.begin() + i * group.size() / chunks,
+                        group.begin() + (i + 1) * group.size() / chunks);
+                    if (chunk.size() == 1) {
+                        next.push_back(chunk[0]);
+                        continue;
+                    }
+                    MergeOutput out;
+                    out.unique = &pass->keys;
+                    out.values = &pass->values;
+                    out.compression = &options_.new_state_compression;
+                    merge_runs(chunk, std::vector<KeyRun>(), out);
+                    pass->unseen.push_back(unseen);
+                }
+            }
+            // The runs of the pass can only be looked up once it's
+            // complete, since appending to an array remaps it.
+            for (int i = 0; i < pass->keys.run_count(); ++i) {
+                PairRun run;
+                run.keys = pass->keys.run(i);
+                run.values = pass->values.run(i);
+                run.unseen = pass->unseen[i];
+                if (run.keys.first != run.keys.second) {
+                    next.push_back(run);
+                }
+            }
+            passes->push_back(std::move(pass));
+            *new_runs = next;
+            ++pass_count;
+
+            // Release the outputs of earlier passes that have been
+            // merged.
+            auto merged = [new_runs] (const std::unique_ptr<NewRuns>& pass) {
+                for (const auto& run : *new_runs) {
+                    if (run.keys.first >= pass->keys.begin() &&
+                        run.keys.first < pass->keys.end()) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+            passes->erase(std::remove_if(passes->begin(), passes->end(),
+                                         merged),
+                          passes->end());
+        }
+
+        if (pass_count) {
+            printf("  merged %ld new runs into %ld in %d passes\n",
+                   initial_runs, new_runs->size(), pass_count);
+        }
+    }
+
+    // The settings for reading _streams_ sorted runs at the same
+    // time. Limits the read ahead, so that the decompressed blocks
+    // of all the runs fit into the memory budget along with the
+    // batches that the merge reads from them.
+    DecompressorOptions merge_decompression(size_t streams) const {
+        DecompressorOptions decompression = options_.decompression;
+        size_t bytes = budget_.read_bytes();
+        size_t batch_bytes = streams * merge_batch_bytes();
+        size_t blocks = (bytes > batch_bytes ? bytes - batch_bytes : 0) /
+            std::max<size_t>(1, streams * max_block_bytes());
+        if (blocks <= (size_t) decompression.read_ahead) {
+            decompression.read_ahead = blocks ? blocks - 1 : 0;
+        }
+        return decompression;
+    }
+
+    // A Array::WriteRun for an array that might be NULL.
+    template<class Array>
+    struct OptionalWriteRun {
+        OptionalWriteRun(Array* array) : array_(array) {
+            if (array_) {
+                array_->thaw();
+                array_->start_run();
+                start_size_ = array_->size();
+            }
+        }
+
+        ~OptionalWriteRun() {
+            if (array_) {
+                array_->end_run();
+                array_->freeze();
+            }
+        }
+
+        // The number of elements written to the run so far.
+        size_t written() const {
+            return array_ ? array_->size() - start_size_ : 0;
+        }
+
+    private:
+        Array* array_;
+        size_t start_size_ = 0;
+    };
+
+    // Does the merge for merge_runs() for the keys in the range
+    // from *lo (inclusive) to *hi (exclusive). If lo or hi are
+    // NULL, the range is unbounded in that direction. If lo is
+    // not NULL, the runs must have been indexed in new_indexes and
+    // seen_indexes. The runs are read with the given decompression
+    // settings.
+    void merge_range(const Key* lo, const Key* hi,
+                     const std::vector<PairRun>& new_runs,
+                     const std::vector<BlockIndex<Key>>* new_indexes,
+                     const std::vector<KeyRun>& seen_runs,
+                     const std::vector<BlockIndex<Key>>* seen_indexes,
+                     const MergeOutput& out,
+                     const DecompressorOptions& decompression) {
+        // Iterate through the new keys / values in tandem. If there
+        // are multiple new runs, interleave the runs togehter into a
+        // single sorted stream. The runs known to be unseen go into
+        // a separate stream, since they don't need to be checked
+        // against the seen runs.
+        PairInterleaver new_stream, unseen_stream;
+        for (int i = 0; i < new_runs.size(); ++i) {
+            const auto& run = new_runs[i];
+            const uint8_t* begin = run.keys.first;
+            size_t skip = 0;
+            if (lo) {
+                const auto& block = (*new_indexes)[i].find(*lo);
+                begin = block.begin;
+                skip = block.records_before;
+            }
+            auto keystream = new KeyStream(begin, run.keys.second,
+                                           decompression);
+            auto valstream = new ValueStream(run.values.first + skip,
+                                             run.values.second);
+            auto stream = new PairStream(keystream, valstream);
+            if (run.unseen) {
+                unseen_stream.add_stream(stream);
+            } else {
+                new_stream.add_stream(stream);
+            }
+        }
+        // Skip the records before the range.
+        new_stream.next();
+        while (lo && !new_stream.empty() && new_stream.value().first < *lo) {
             new_stream.next();
+        }
+        unseen_stream.next();
+        while (lo && !unseen_stream.empty() &&
+               unseen_stream.value().first < *lo) {
+            unseen_stream.next();
+        }
+
+        if (seen_runs.size() == 1 && out.merged) {
+            // A single seen run that's being rewritten: its blocks
+            // that no new states fall into can be copied to the
+            // output as is, without decompressing them.
+            BlockIndex<Key> local_index;
+            const BlockIndex<Key>* index;
+            if (seen_indexes) {
+                index = &(*seen_indexes)[0];
+            } else {
+                local_index = BlockIndex<Key>(seen_runs[0].first,
+                                              seen_runs[0].second);
+                index = &local_index;
+            }
+            size_t first = 0;
+            if (lo && !index->blocks().empty()) {
+                first = &index->find(*lo) - &index->blocks()[0];
+            }
+            SeenBlockStream seen_stream(*index, first,
+                                        decompression);
+            if (lo && !seen_stream.empty() && seen_stream.block().first < *lo) {
+                while (!seen_stream.empty() && seen_stream.value() < *lo) {
+                    seen_stream.next();
+                }
+            }
+            merge_streams(hi, &new_stream, &unseen_stream, &seen_stream,
+                          index, out);
+            return;
+        }
+
+        // The seen runs are disjoint, so they can be merged into a
+        // single sorted stream without any special handling of
+        // duplicates.
+        KeyInterleaver seen_stream;
+        for (int i = 0; i < seen_runs.size(); ++i) {
+            const auto& run = seen_runs[i];
+            const uint8_t* begin = run.first;
+            if (lo) {
+                begin = (*seen_indexes)[i].find(*lo).begin;
+            }
+            seen_stream.add_stream(new KeyStream(begin, run.second,
+                                                 decompression));
+        }
+        seen_stream.next();
+        while (lo && !seen_stream.empty() && seen_stream.value() < *lo) {
+            seen_stream.next();
+        }
+        merge_streams(hi, &new_stream, &unseen_stream, &seen_stream,
+                      (const BlockIndex<Key>*) NULL, out);
+    }
+
+    using SeenBlockStream = BlockIndexStream<Key>;
+
+    // Does the merge of merge_range() from the current positions of
+    // the streams, up to *hi (exclusive, or to the end if hi is NULL).
+    // seen_index is the index of seen_stream, if it's a
+    // SeenBlockStream.
+    template<class SeenStream>
+    void merge_streams(const Key* hi, PairInterleaver* new_stream,
+                       PairInterleaver* unseen_stream,
+                       SeenStream* seen_stream,
+                       const BlockIndex<Key>* seen_index,
+                       const MergeOutput& out) {
+        auto have_pair = [hi] (PairInterleaver* stream) {
+            return !stream->empty() && (!hi || stream->value().first < *hi);
+        };
+        auto have_key = [hi] (SeenStream* stream) {
+            return !stream->empty() && (!hi || stream->value() < *hi);
+        };
+
+        OptionalWriteRun<Keys> unique_writer(out.unique);
+        OptionalWriteRun<Values> value_writer(out.values);
+        OptionalWriteRun<Keys> merged_writer(out.merged);
+        size_t copied = 0;
+        {
+            std::unique_ptr<KeyCompressor> compress, compress_merged;
+            if (out.unique) {
+                compress.reset(new KeyCompressor(
+                    out.unique,
+                    out.compression ? *out.compression : options_.compression));
+            }
+            if (out.merged) {
+                compress_merged.reset(new KeyCompressor(out.merged,
+                                                        options_.compression));
+            }
 
             while (1) {
-                bool have_new = !new_stream.empty();
-                bool have_old = !merged_stream.empty();
-                if (have_new && have_old) {
-                    auto new_st = new_stream.value().first;
-                    auto old_st = merged_stream.value();
-                    if (old_st < new_st) {
-                        compress_merged.pack(old_st.bytes());
-                        merged_stream.next();
-                    } else if (old_st == new_st) {
-                        compress_merged.pack(old_st.bytes());
-                        merged_stream.next();
-                        new_stream.next();
-                    } else {
-                        compress.pack(new_st.bytes());
-                        compress_merged.pack(new_st.bytes());
-                        values_by_depth->push_back(new_stream.value().second);
-                        new_stream.next();
-                    }
-                } else if (have_old) {
-                    auto old_st = merged_stream.value();
-                    compress_merged.pack(old_st.bytes());
-                    merged_stream.next();
-                } else if (have_new) {
-                    auto new_st = new_stream.value().first;
-                    compress.pack(new_st.bytes());
-                    compress_merged.pack(new_st.bytes());
-                    values_by_depth->push_back(new_stream.value().second);
-                    new_stream.next();
+                // Pick the next smallest new state from either of
+                // the new streams.
+                PairInterleaver* stream;
+                bool have_new = have_pair(new_stream);
+                bool have_unseen = have_pair(unseen_stream);
+                if (have_new &&
+                    (!have_unseen ||
+                     new_stream->value().first < unseen_stream->value().first)) {
+                    stream = new_stream;
+                } else if (have_unseen) {
+                    stream = unseen_stream;
                 } else {
                     break;
                 }
+                const auto& new_st = stream->value().first;
+
+                // Catch up with the seen states. If the state is
+                // known to be unseen and there's no merged output,
+                // the seen states don't need to be looked at yet.
+                if (compress_merged || stream == new_stream) {
+                    while (1) {
+                        if (compress_merged) {
+                            copied += copy_seen_blocks(seen_stream, seen_index,
+                                                       &new_st, hi,
+                                                       compress_merged.get());
+                        }
+                        if (!have_key(seen_stream) ||
+                            !(seen_stream->value() < new_st)) {
+                            break;
+                        }
+                        if (compress_merged) {
+                            compress_merged->pack(seen_stream->value().bytes());
+                        }
+                        seen_stream->next();
+                    }
+                }
+
+                if (stream == new_stream && have_key(seen_stream) &&
+                    seen_stream->value() == new_st) {
+                    if (compress_merged) {
+                        compress_merged->pack(new_st.bytes());
+                    }
+                    seen_stream->next();
+                    stream->next();
+                    continue;
+                }
+
+                if (compress) {
+                    compress->pack(new_st.bytes());
+                    out.values->push_back(stream->value().second);
+                    if (out.filter) {
+                        out.filter->insert(new_st.hash());
+                    }
+                }
+                if (compress_merged) {
+                    compress_merged->pack(new_st.bytes());
+                }
+                stream->next();
+            }
+
+            // Copy the remaining seen states.
+            while (compress_merged) {
+                copied += copy_seen_blocks(seen_stream, seen_index, NULL, hi,
+                                           compress_merged.get());
+                if (!have_key(seen_stream)) {
+                    break;
+                }
+                compress_merged->pack(seen_stream->value().bytes());
+                seen_stream->next();
             }
         }
 
-        std::swap(*all_keys, new_all_keys);
+        std::lock_guard<std::mutex> lock(io_mutex_);
+        io_.written += unique_writer.written() + value_writer.written() +
+            merged_writer.written();
+        io_.copied += copied;
+    }
+
+    // Copies the blocks at the front of seen_stream to compress as is,
+    // as long as all their states are known to be smaller than both
+    // *limit and *hi (where NULL means no limit). Returns the number of
+    // bytes copied.
+    static size_t copy_seen_blocks(SeenBlockStream* seen_stream,
+                                   const BlockIndex<Key>* seen_index,
+                                   const Key* limit, const Key* hi,
+                                   KeyCompressor* compress) {
+        size_t copied = 0;
+        while (seen_stream->at_block_start()) {
+            // All the states of a block are smaller than the first
+            // state of the next block. The states of the last block
+            // are only known to be smaller than infinity.
+            const auto* next = seen_stream->next_block();
+            if (next ? ((limit && *limit < next->first) ||
+                        (hi && *hi < next->first)) :
+                (limit || hi)) {
+                break;
+            }
+            const auto& block = seen_stream->block();
+            const uint8_t* end = seen_index->block_end(block);
+            compress->append_block(block.begin, end);
+            copied += std::distance(block.begin, end);
+            seen_stream->skip_block();
+        }
+        return copied;
+    }
 
-        auto last_run = values_by_depth->run(values_by_depth->run_count() - 1);
-        size_t count = std::distance(last_run.first, last_run.second);
-        return count;
+    // The blocks of a merge of several seen runs can't be copied.
+    static size_t copy_seen_blocks(KeyInterleaver* seen_stream,
+                                   const BlockIndex<Key>* seen_index,
+                                   const Key* limit, const Key* hi,
+                                   KeyCompressor* compress) {
+        return 0;
     }
+
+    BFSOptions options_;
+    MemoryBudget budget_;
+    // The maximum number of new states to collect in memory before
+    // sorting and compressing them into a run.
+    size_t max_new_states_;
+    // A filter containing all the states in the seen set, or NULL
+    // if options_.filter_bytes is 0.
+    std::unique_ptr<BlockedBloomFilter> filter_;
+    // The workers for compressing blocks in the background, or NULL
+    // if options_.compression_threads is 0.
+    std::unique_ptr<ThreadPool> compression_pool_;
+    // The workers for decompressing blocks ahead of time, or NULL if
+    // options_.read_ahead_threads is 0.
+    std::unique_ptr<ThreadPool> read_ahead_pool_;
+    // Collects samples for training dictionary_, until there are
+    // enough of them.
+    std::unique_ptr<ZstdSampler> sampler_;
+    // The dictionary used for compressing new blocks, or NULL.
+    std::unique_ptr<ZstdDictionary> dictionary_;
+    // Whether dictionary_ has been written to the checkpoint
+    // directory.
+    bool dictionary_written_ = false;
+    // The id to use for the next seen set file written to a
+    // checkpoint.
+    int next_file_id_ = 0;
+    // The ids of the seen set files referenced by the latest
+    // checkpoint, or created since then.
+    std::vector<int> seen_file_ids_;
+    // The I/O done by dedup on the current depth.
+    IoStats io_;
+    std::mutex io_mutex_;
 };
 
 #endif
@@ -12,7 +12,7 @@ int main() {
         "........................";
 
 
-    using St = State<Setup<8, 24, 2, 1, 5>>;
+    using St = State<Setup<8, 24, 2, 1, 5, 0, 0, 106>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -14,7 +14,7 @@ int main() {
         ".  ...   ."
         "~~~~~~~~~~";
 
-    using St = State<Setup<11, 10, 2, 1, 4, 0>>;
+    using St = State<Setup<11, 10, 2, 1, 4, 0, 0, 57>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
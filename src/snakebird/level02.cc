@@ -15,7 +15,7 @@ int main() {
         "........  ."
         "~~~~~~~~~~~";
 
-    using St = State<Setup<12, 11, 2, 1, 5>>;
+    using St = State<Setup<12, 11, 2, 1, 5, 0, 0, 47>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -13,7 +13,7 @@ int main() {
         ". .    ..."
         "~~~~~~~~~~";
 
-    using St = State<Setup<10, 10, 2, 1, 5>>;
+    using St = State<Setup<10, 10, 2, 1, 5, 0, 0, 41>>;
     St::Map map(base_map);
     St st(map);
 
@@ -16,7 +16,7 @@ int main() {
         ".    ..  ."
         "~~~~~~~~~~";
 
-    using St = State<Setup<13, 10, 1, 1, 5>>;
+    using St = State<Setup<13, 10, 1, 1, 5, 0, 0, 73>>;
     St::Map map(base_map);
     St st(map);
 
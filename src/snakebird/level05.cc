@@ -12,7 +12,7 @@ int main() {
         ". ^.~  ."
         "~~~~~~~~";
 
-    using St = State<Setup<9, 8, 2, 1, 5>>;
+    using St = State<Setup<9, 8, 2, 1, 5, 0, 0, 33>>;
     St::Map map(base_map);
     St st(map);
 
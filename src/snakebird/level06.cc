@@ -17,7 +17,7 @@ int main() {
         "~~~~~~~~~~~~";
 
 
-    using St = State<Setup<13, 12, 1, 1, 5>>;
+    using St = State<Setup<13, 12, 1, 1, 5, 0, 0, 91>>;
     St::Map map(base_map);
     St st(map);
 
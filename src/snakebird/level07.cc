@@ -15,7 +15,7 @@ int main() {
         ".       .... ."
         "~~~~~~~~~~~~~~";
 
-    using St = State<Setup<12, 14, 0, 2, 4>>;
+    using St = State<Setup<12, 14, 0, 2, 4, 0, 0, 110>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
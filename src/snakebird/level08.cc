@@ -11,7 +11,7 @@ int main() {
         ". .....  ~~.~    ."
         "~~~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<8, 18, 0, 2, 5>>;
+    using St = State<Setup<8, 18, 0, 2, 5, 0, 0, 69>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -22,7 +22,7 @@ int main() {
         "..... ..^."
         "~~~~~~~~~~";
 
-    using St = State<Setup<19, 10, 0, 2, 5>>;
+    using St = State<Setup<19, 10, 0, 2, 5, 0, 0, 119>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
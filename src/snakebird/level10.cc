@@ -17,7 +17,7 @@ int main() {
         ".     ....   ."
         "~~~~~~~~~~~~~~";
 
-    using St = State<Setup<14, 14, 2, 1, 6>>;
+    using St = State<Setup<14, 14, 2, 1, 6, 0, 0, 107>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
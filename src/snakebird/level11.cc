@@ -16,7 +16,7 @@ int main() {
         ".     ^      ."
         "~~~~~~~~~~~~~~";
 
-    using St = State<Setup<13, 14, 7, 1, 15>>;
+    using St = State<Setup<13, 14, 7, 1, 15, 0, 0, 91>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
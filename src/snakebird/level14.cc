@@ -14,7 +14,7 @@ int main() {
         ".   .   . . ."
         "~~~~~~~~~~~~~";
 
-    using St = State<Setup<11, 13, 0, 2, 3>>;
+    using St = State<Setup<11, 13, 0, 2, 3, 0, 0, 86>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
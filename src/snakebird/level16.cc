@@ -19,7 +19,7 @@ int main() {
         ".   .    ."
         "~~~~~~~~~~";
 
-    using St = State<Setup<16, 10, 0, 3, 4>>;
+    using St = State<Setup<16, 10, 0, 3, 4, 0, 0, 104>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
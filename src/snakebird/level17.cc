@@ -19,7 +19,7 @@ int main() {
         ".    ~~~    ."
         "~~~~~~~~~~~~~";
 
-    using St = State<Setup<16, 13, 0, 2, 5>>;
+    using St = State<Setup<16, 13, 0, 2, 5, 0, 0, 124>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -19,7 +19,7 @@ int main() {
         ".      ..~       ."
         "~~~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<16, 18, 0, 2, 4>>;
+    using St = State<Setup<16, 18, 0, 2, 4, 0, 0, 196>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
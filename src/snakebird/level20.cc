@@ -14,7 +14,7 @@ int main() {
         ".   ...   .  .. ."
         "~~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<11, 17, 2, 2, 4>>;
+    using St = State<Setup<11, 17, 2, 2, 4, 0, 0, 101>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
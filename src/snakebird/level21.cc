@@ -17,7 +17,7 @@ int main() {
         ". ..     .. ."
         "~~~~~~~~~~~~~";
 
-    using St = State<Setup<14, 13, 3, 1, 9, 0>>;
+    using St = State<Setup<14, 13, 3, 1, 9, 0, 0, 106>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -16,7 +16,7 @@ int main() {
         ".   ....... ."
         "~~~~~~~~~~~~~";
 
-    using St = State<Setup<13, 13, 0, 1, 3, 1>>;
+    using St = State<Setup<13, 13, 0, 1, 3, 1, 0, 98>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -20,7 +20,7 @@ int main() {
         ".    .   .    .   ."
         "~~~~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<17, 19, 0, 1, 11, 2>>;
+    using St = State<Setup<17, 19, 0, 1, 11, 2, 0, 184>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -21,7 +21,7 @@ int main() {
         ".    .   .    ."
         "~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<18, 15, 0, 2, 4, 1>>;
+    using St = State<Setup<18, 15, 0, 2, 4, 1, 0, 196>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -16,7 +16,7 @@ int main() {
         ".  ...  ........"
         "~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<13, 16, 1, 2, 4, 1>>;
+    using St = State<Setup<13, 16, 1, 2, 4, 1, 0, 108>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
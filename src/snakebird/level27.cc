@@ -19,7 +19,7 @@ int main() {
         ". ......   ."
         "~~~~~~~~~~~~";
 
-    using St = State<Setup<16, 12, 1, 2, 5, 1>>;
+    using St = State<Setup<16, 12, 1, 2, 5, 1, 0, 108>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
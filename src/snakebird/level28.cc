@@ -17,7 +17,7 @@ int main() {
         ".  ..... ."
         "~~~~~~~~~~";
 
-    using St = State<Setup<14, 10, 1, 2, 4, 1>>;
+    using St = State<Setup<14, 10, 1, 2, 4, 1, 0, 76>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
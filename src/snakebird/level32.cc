@@ -13,7 +13,7 @@ int main() {
         ".  .  .      ."
         "~~~~~~~~~~~~~~";
 
-    using St = State<Setup<10, 14, 0, 2, 2, 1, 1>>;
+    using St = State<Setup<10, 14, 0, 2, 2, 1, 1, 76>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -17,7 +17,7 @@ int main() {
         ".   ... ..  . ."
         "~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<14, 15, 2, 1, 5, 0, 1>>;
+    using St = State<Setup<14, 15, 2, 1, 5, 0, 1, 122>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -12,7 +12,7 @@ int main() {
         ".   ..... ."
         "~~~~~~~~~~~";
 
-    using St = State<Setup<9, 11, 0, 2, 2, 1, 1>>;
+    using St = State<Setup<9, 11, 0, 2, 2, 1, 1, 49>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
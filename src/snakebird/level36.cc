@@ -16,7 +16,7 @@ int main() {
         ".           .      ."
         "~~~~~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<13, 20, 0, 2, 6, 0, 1>>;
+    using St = State<Setup<13, 20, 0, 2, 6, 0, 1, 155>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
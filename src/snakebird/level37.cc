@@ -14,7 +14,7 @@ int main() {
         ".   .....    ."
         "~~~~~~~~~~~~~~";
 
-    using St = State<Setup<11, 14, 0, 2, 3, 0, 1>>;
+    using St = State<Setup<11, 14, 0, 2, 3, 0, 1, 88>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
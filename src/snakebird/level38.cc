@@ -15,7 +15,7 @@ int main() {
         ". .......     ."
         "~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<12, 15, 0, 2, 4, 0, 1>>;
+    using St = State<Setup<12, 15, 0, 2, 4, 0, 1, 112>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -23,7 +23,7 @@ int main() {
         ".  ...    . .  ."
         "~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<20, 16, 0, 1, 5, 2>>;
+    using St = State<Setup<20, 16, 0, 1, 5, 2, 0, 178>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
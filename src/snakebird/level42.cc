@@ -15,7 +15,7 @@ int main() {
         ".   .. .   .  ."
         "~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<12, 15, 2, 2, 4, 0>>;
+    using St = State<Setup<12, 15, 2, 2, 4, 0, 0, 103>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
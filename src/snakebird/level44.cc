@@ -15,7 +15,7 @@ int main() {
         ".    . .   . ."
         "~~~~~~~~~~~~~~";
 
-    using St = State<Setup<12, 14, 2, 2, 4, 0, 1>>;
+    using St = State<Setup<12, 14, 2, 2, 4, 0, 1, 104>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
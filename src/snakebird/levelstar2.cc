@@ -17,7 +17,7 @@ int main() {
         ".    ...          ."
         "~~~~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<14, 19, 26, 1, 29, 0>>;
+    using St = State<Setup<14, 19, 26, 1, 29, 0, 0, 136>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
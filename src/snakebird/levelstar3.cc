@@ -20,7 +20,7 @@ int main() {
         ".        .         ."
         "~~~~~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<17, 20, 0, 3, 4, 1>>;
+    using St = State<Setup<17, 20, 0, 3, 4, 1, 0, 251>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
@@ -17,7 +17,7 @@ int main() {
         ".    ..     ."
         "~~~~~~~~~~~~~";
 
-    using St = State<Setup<14, 13, 0, 2, 3, 3>>;
+    using St = State<Setup<14, 13, 0, 2, 3, 3, 0, 113>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
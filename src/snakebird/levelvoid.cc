@@ -22,7 +22,7 @@ int main() {
         ".          .    ."
         "~~~~~~~~~~~~~~~~~";
 
-    using St = State<Setup<19, 17, 3, 3, 5, 1>>;
+    using St = State<Setup<19, 17, 3, 3, 5, 1, 0, 224>>;
     St::Map map(base_map);
     St st(map);
     st.print(map);
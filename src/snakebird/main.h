@@ -13,6 +13,8 @@
 #include "bit-packer.h"
 #include "compress.h"
 #include "file-backed-array.h"
+#include "hash-search.h"
+#include "memory-budget.h"
 #include "snakebird/snakebird.h"
 #include "search.h"
 
@@ -25,6 +27,132 @@
         } \
     } while (0)
 
+// Reads the search tuning knobs from the environment.
+//
+// SNAKEBIRD_THREADS: The number of threads to use for the search.
+// SNAKEBIRD_COMPRESSION_THREADS: The number of background threads for
+//   compressing the sorted runs.
+// SNAKEBIRD_READ_AHEAD_THREADS: The number of background threads for
+//   decompressing blocks ahead of time.
+// SNAKEBIRD_READ_AHEAD_BLOCKS: The number of blocks of each sorted run
+//   to decompress ahead of time (default 2).
+// SNAKEBIRD_SEEN_RATIO: The size ratio between the runs of the seen
+//   set (see BFSOptions::seen_size_ratio).
+// SNAKEBIRD_FILTER_MB: The size of the filter for detecting new states
+//   that have definitely not been seen before, in megabytes.
+// SNAKEBIRD_CHECKPOINT_DIR: A directory to checkpoint the search to
+//   after every depth.
+// SNAKEBIRD_RESUME: If set to 1, resumes the search from the checkpoint
+//   in SNAKEBIRD_CHECKPOINT_DIR.
+// SNAKEBIRD_ZSTD_LEVEL: The zstd compression level.
+// SNAKEBIRD_CODEC: The codec for compressing the sorted runs, as
+//   name[:level], where name is one of none, lz4, zstd or zstd-long
+//   (e.g. "zstd:9").
+// SNAKEBIRD_NEW_STATE_CODEC: The codec for compressing just the runs
+//   of new states. Defaults to SNAKEBIRD_CODEC.
+// SNAKEBIRD_FORMAT: The format of the sorted runs before the codec is
+//   applied: delta (the default) or elias-fano.
+// SNAKEBIRD_NEW_STATE_FORMAT: The format of just the runs of new
+//   states. Defaults to SNAKEBIRD_FORMAT.
+// SNAKEBIRD_BLOCK_KB: The size of the compressed blocks, in kilobytes
+//   (before compression).
+// SNAKEBIRD_DICT_KB: If set, trains a zstd dictionary of this many
+//   kilobytes for compressing the blocks.
+// SNAKEBIRD_CODEC_BENCH: If set to 1, benchmarks the codecs on the
+//   states of each depth.
+// SNAKEBIRD_MEMORY_MB: The memory budget for the buffers of the
+//   search, in megabytes. Defaults to half of the memory limit of
+//   the cgroup, or of the physical memory if there's no limit.
+// SNAKEBIRD_MAX_FAN_IN: The maximum number of sorted runs to merge
+//   at once. Defaults to what fits into the memory budget.
+BFSOptions search_options() {
+    BFSOptions options;
+    if (const char* threads = getenv("SNAKEBIRD_THREADS")) {
+        options.threads = std::max(1, atoi(threads));
+    }
+    if (const char* threads = getenv("SNAKEBIRD_COMPRESSION_THREADS")) {
+        options.compression_threads = std::max(0, atoi(threads));
+    }
+    if (const char* threads = getenv("SNAKEBIRD_READ_AHEAD_THREADS")) {
+        options.read_ahead_threads = std::max(0, atoi(threads));
+    }
+    if (const char* blocks = getenv("SNAKEBIRD_READ_AHEAD_BLOCKS")) {
+        options.decompression.read_ahead = std::max(0, atoi(blocks));
+    }
+    if (const char* ratio = getenv("SNAKEBIRD_SEEN_RATIO")) {
+        options.seen_size_ratio = std::max(0.0, atof(ratio));
+    }
+    if (const char* filter_mb = getenv("SNAKEBIRD_FILTER_MB")) {
+        options.filter_bytes = std::max(0L, atol(filter_mb)) << 20;
+    }
+    if (const char* dir = getenv("SNAKEBIRD_CHECKPOINT_DIR")) {
+        options.checkpoint_dir = dir;
+    }
+    if (const char* resume = getenv("SNAKEBIRD_RESUME")) {
+        options.resume = atoi(resume) != 0;
+    }
+    if (const char* level = getenv("SNAKEBIRD_ZSTD_LEVEL")) {
+        options.compression.level = atoi(level);
+    }
+    if (const char* codec = getenv("SNAKEBIRD_CODEC")) {
+        if (!parse_block_codec(codec, &options.compression)) {
+            fprintf(stderr, "Invalid SNAKEBIRD_CODEC: %s\n", codec);
+            exit(1);
+        }
+    }
+    if (const char* format = getenv("SNAKEBIRD_FORMAT")) {
+        if (!parse_run_format(format, &options.compression)) {
+            fprintf(stderr, "Invalid SNAKEBIRD_FORMAT: %s\n", format);
+            exit(1);
+        }
+    }
+    if (const char* block_kb = getenv("SNAKEBIRD_BLOCK_KB")) {
+        options.compression.block_size =
+            std::min(2048L, std::max(1L, atol(block_kb))) << 10;
+    }
+    if (const char* dict_kb = getenv("SNAKEBIRD_DICT_KB")) {
+        options.dictionary_bytes = std::max(0L, atol(dict_kb)) << 10;
+    }
+    options.new_state_compression = options.compression;
+    if (const char* codec = getenv("SNAKEBIRD_NEW_STATE_CODEC")) {
+        if (!parse_block_codec(codec, &options.new_state_compression)) {
+            fprintf(stderr, "Invalid SNAKEBIRD_NEW_STATE_CODEC: %s\n",
+                    codec);
+            exit(1);
+        }
+    }
+    if (const char* format = getenv("SNAKEBIRD_NEW_STATE_FORMAT")) {
+        if (!parse_run_format(format, &options.new_state_compression)) {
+            fprintf(stderr, "Invalid SNAKEBIRD_NEW_STATE_FORMAT: %s\n",
+                    format);
+            exit(1);
+        }
+    }
+    if (const char* bench = getenv("SNAKEBIRD_CODEC_BENCH")) {
+        options.codec_benchmark = atoi(bench) != 0;
+    }
+    if (const char* memory_mb = getenv("SNAKEBIRD_MEMORY_MB")) {
+        options.memory_bytes = std::max(0L, atol(memory_mb)) << 20;
+    }
+    if (const char* fan_in = getenv("SNAKEBIRD_MAX_FAN_IN")) {
+        options.max_fan_in = std::max(0, atoi(fan_in));
+    }
+    return options;
+}
+
+// The maximum amount of memory to use for searching with
+// HashTableSearch before falling back to BreadthFirstSearch, read
+// from SNAKEBIRD_HASH_MB. If 0, BreadthFirstSearch is used from the
+// start. Defaults to 1GB, or half of the memory budget of the search
+// if that's smaller.
+size_t hash_search_bytes(const BFSOptions& options) {
+    if (const char* hash_mb = getenv("SNAKEBIRD_HASH_MB")) {
+        return std::max(0L, atol(hash_mb)) << 20;
+    }
+    return std::min(size_t(1) << 30,
+                    MemoryBudget(options.memory_bytes).bytes() / 2);
+}
+
 template<class St, class Map>
 int search(St start_state, const Map& map) {
     class SnakeBirdSearch {
@@ -39,6 +167,24 @@ int search(St start_state, const Map& map) {
         }
     };
 
-    BreadthFirstSearch<St, Map, SnakeBirdSearch> bfs;
-    return bfs.search(start_state, map);
+    // Most levels are small enough to be solved in memory. Only
+    // switch to the external memory search if that turns out not
+    // to be the case. (Or if resuming an external memory search
+    // from a checkpoint).
+    BFSOptions options = search_options();
+    typename HashTableSearch<St, Map, SnakeBirdSearch>::Layers layers;
+    size_t max_bytes = hash_search_bytes(options);
+    if (max_bytes && !options.resume) {
+        HashTableSearch<St, Map, SnakeBirdSearch> hash_search(max_bytes);
+        int depth = hash_search.search(start_state, map, &layers);
+        if (depth >= 0) {
+            return depth;
+        }
+    } else {
+        layers.resize(1);
+        layers[0].emplace_back(start_state, 0);
+    }
+
+    BreadthFirstSearch<St, Map, SnakeBirdSearch> bfs(options);
+    return bfs.search(&layers, map);
 }
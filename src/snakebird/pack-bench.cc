@@ -0,0 +1,257 @@
+// Benchmarks serializing and deserializing States with the fixed
+// field layout (Packer::Words), against serializing the same fields
+// one after another with Packer::deposit / extract.
+//
+// Also measures how well the sorted runs of states compress with
+// each FieldOrder: the states reached by a breadth-first search of
+// the level are split into runs by depth, and each run is sorted and
+// compressed with the default CompressorOptions.
+//
+// Usage: pack-bench [states]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <vector>
+
+#include "bit-packer.h"
+#include "compress.h"
+#include "snakebird/snakebird.h"
+
+// The number of times to repeat each measurement.
+static const int kRepeats = 5;
+
+// Serializes the fields in order with the Packer stream interface,
+// ignoring their offsets. This is how states were serialized before
+// Packer::Words.
+template<class P>
+struct StreamWords {
+    explicit StreamWords(P* packer) : packer_(packer) {
+    }
+
+    template<typename T>
+    void put(T data, int offset, int width) {
+        packer_->deposit(data, width, &context_);
+    }
+
+    template<typename T>
+    void get(T& data, int offset, int width) {
+        packer_->extract(data, width, &context_);
+    }
+
+    void flush() {
+        packer_->flush(&context_);
+    }
+
+private:
+    P* packer_;
+    typename P::Context context_;
+};
+
+// Keeps the compiler from optimizing away the computation of *value.
+template<class T>
+void use(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+// Returns the best time in nanoseconds per state of kRepeats calls
+// to fun(i) for each of the count states.
+template<class Fun>
+double time_per_state(size_t count, Fun fun) {
+    double best = 0;
+    for (int r = 0; r < kRepeats; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < count; ++i) {
+            fun(i);
+        }
+        std::chrono::duration<double, std::nano> elapsed =
+            std::chrono::steady_clock::now() - start;
+        double ns = elapsed.count() / count;
+        best = r ? std::min(best, ns) : ns;
+    }
+    return best;
+}
+
+// Collects up to count distinct states reachable from the initial
+// state, breadth first. Sets *depth_ends to the index past the last
+// state of each depth.
+template<class St>
+std::vector<St> collect_states(const typename St::Map& map, size_t count,
+                               std::vector<size_t>* depth_ends) {
+    using Packed = typename St::Packed;
+    std::vector<St> states { St(map) };
+    std::set<Packed> seen { Packed(states[0]) };
+    depth_ends->clear();
+    depth_ends->push_back(1);
+    for (size_t i = 0; i < states.size() && states.size() < count; ++i) {
+        if (i == depth_ends->back()) {
+            depth_ends->push_back(states.size());
+        }
+        St st = states[i];
+        st.do_valid_moves(map, [&] (St new_state) {
+                if (states.size() < count &&
+                    seen.insert(Packed(new_state)).second) {
+                    states.push_back(new_state);
+                }
+                return false;
+            });
+    }
+    if (depth_ends->back() != states.size()) {
+        depth_ends->push_back(states.size());
+    }
+    return states;
+}
+
+// Counts the bytes written by a ByteArrayDeltaCompressor.
+struct ByteCounter {
+    template<class It>
+    void insert_back(It begin, It end) {
+        bytes += end - begin;
+    }
+
+    size_t bytes = 0;
+};
+
+// Returns the compressed size in bits per state of the states
+// serialized in the given field order, as sorted runs split at
+// depth_ends.
+template<class Order, class Setup, class StateOrder>
+double bits_per_state(const std::vector<State<Setup, StateOrder>>& states,
+                      const std::vector<size_t>& depth_ends) {
+    using OrderedState = State<Setup, Order>;
+    using Packed = typename OrderedState::Packed;
+    ByteCounter counter;
+    size_t begin = 0;
+    for (size_t end : depth_ends) {
+        std::vector<Packed> run;
+        for (size_t i = begin; i < end; ++i) {
+            run.emplace_back(OrderedState(states[i]));
+        }
+        std::sort(run.begin(), run.end());
+        ByteArrayDeltaCompressor<Packed::width_bytes(), ByteCounter, Packed>
+            compress { &counter };
+        for (const auto& packed : run) {
+            compress.pack(packed.bytes());
+        }
+        begin = end;
+    }
+    return counter.bytes * 8.0 / states.size();
+}
+
+template<class St>
+void benchmark(const char* name, const char* base_map, size_t max_states) {
+    using Packed = typename St::Packed;
+    using P = typename Packed::P;
+
+    typename St::Map map(base_map);
+    std::vector<size_t> depth_ends;
+    std::vector<St> states = collect_states<St>(map, max_states,
+                                                &depth_ends);
+    size_t count = states.size();
+    std::vector<Packed> packed(count), stream_packed(count);
+
+    double stream_pack = time_per_state(count, [&] (size_t i) {
+            P p;
+            StreamWords<P> words(&p);
+            states[i].pack(&words);
+            words.flush();
+            stream_packed[i].p_ = p;
+        });
+    double layout_pack = time_per_state(count, [&] (size_t i) {
+            packed[i] = Packed(states[i]);
+        });
+    double stream_unpack = time_per_state(count, [&] (size_t i) {
+            P p = stream_packed[i].p_;
+            StreamWords<P> words(&p);
+            St st;
+            st.unpack(&words);
+            use(st);
+        });
+    double layout_unpack = time_per_state(count, [&] (size_t i) {
+            St st(packed[i]);
+            use(st);
+        });
+
+    for (size_t i = 0; i < count; ++i) {
+        P p = stream_packed[i].p_;
+        StreamWords<P> words(&p);
+        St st;
+        st.unpack(&words);
+        if (!(Packed(st) == packed[i]) ||
+            !(Packed(St(packed[i])) == packed[i])) {
+            fprintf(stderr, "%s: serializations of state %ld differ\n",
+                    name, i);
+            abort();
+        }
+    }
+
+    printf("%-6s %3d bits %8ld states  pack %6.1f -> %6.1f ns  "
+           "unpack %6.1f -> %6.1f ns\n",
+           name, (int) Packed::width_bytes() * 8, count,
+           stream_pack, layout_pack, stream_unpack, layout_unpack);
+
+    // S = snakes, F = fruit, G = gadgets, most significant first.
+    printf("%-6s %ld depths, bits/state:  FGS %5.2f  GFS %5.2f  "
+           "FSG %5.2f  GSF %5.2f  SFG %5.2f  SGF %5.2f\n",
+           name, depth_ends.size(),
+           bits_per_state<FieldOrder<Field::kFruit, Field::kGadgets,
+                                     Field::kSnakes>>(states, depth_ends),
+           bits_per_state<FieldOrder<Field::kGadgets, Field::kFruit,
+                                     Field::kSnakes>>(states, depth_ends),
+           bits_per_state<FieldOrder<Field::kFruit, Field::kSnakes,
+                                     Field::kGadgets>>(states, depth_ends),
+           bits_per_state<FieldOrder<Field::kGadgets, Field::kSnakes,
+                                     Field::kFruit>>(states, depth_ends),
+           bits_per_state<FieldOrder<Field::kSnakes, Field::kFruit,
+                                     Field::kGadgets>>(states, depth_ends),
+           bits_per_state<FieldOrder<Field::kSnakes, Field::kGadgets,
+                                     Field::kFruit>>(states, depth_ends));
+}
+
+int main(int argc, char** argv) {
+    size_t states = argc > 1 ? atol(argv[1]) : 1000000;
+    benchmark<State<Setup<17, 19, 0, 1, 11, 2, 0, 184>>>(
+        "23",
+        "..................."
+        ".                 ."
+        ".                 ."
+        ".          #      ."
+        ".          ###### ."
+        ".        0 .....# ."
+        ".        111 ...# ."
+        ". >>>>B    ...... ."
+        ". ^...... ....... ."
+        ". ^......0....... ."
+        ". ^  .*#.     .   ."
+        ". ^  . #.  .  .   ."
+        ". ^  . #      .   ."
+        ". ^  . #      .   ."
+        ".    . # #    .   ."
+        ".    .   .    .   ."
+        "~~~~~~~~~~~~~~~~~~~", states);
+    benchmark<State<Setup<19, 17, 3, 3, 5, 1, 0, 224>>>(
+        "void",
+        "................."
+        ".    ....       ."
+        ".     ....      ."
+        ".     .O.  O    ."
+        ".     .O.       ."
+        ".   0           ."
+        ".   B<          ."
+        ".  >GR<         ."
+        ".  ....#        ."
+        ".  ...          ."
+        ".   ...      *  ."
+        ".    .          ."
+        ".   .      #    ."
+        ".          .    ."
+        ".          .    ."
+        ".          .    ."
+        ".          .    ."
+        ".          .    ."
+        "~~~~~~~~~~~~~~~~~", states);
+    return 0;
+}
@@ -73,9 +73,13 @@ using Coord = int;
 //   grow to. (Normally the maximum initial length + number of fruit).
 // GadgetCount: Number of other pushable objects on the board.
 // TeleporterCount: Number of teleporters on the map.
+// AnchorCells: If non-zero, the number of empty cells on the map.
+//   Positions are then serialized as indices into those cells (see
+//   CellIndex) rather than as coordinates.
 template<Coord H_, Coord W_, int FruitCount_,
          int SnakeCount_, int SnakeMaxLen_,
-         int GadgetCount_=0, int TeleporterCount_=0>
+         int GadgetCount_=0, int TeleporterCount_=0,
+         int AnchorCells_=0>
 struct Setup {
     static const Coord H = H_;
     static const Coord W = W_;
@@ -84,6 +88,7 @@ struct Setup {
     static const int SnakeMaxLen = SnakeMaxLen_;
     static const int GadgetCount = GadgetCount_;
     static const int TeleporterCount = TeleporterCount_;
+    static const int AnchorCells = AnchorCells_;
     static const int ObjCount = SnakeCount + GadgetCount;
 
     static const int MapSize = Setup::H * Setup::W;
@@ -91,8 +96,8 @@ struct Setup {
     // Number of bits used to pack a direction.
     static const int kDirBits = 2;
     static const uint64_t kDirMask = mask_n_bits(kDirBits);
-    static const int kIndexBits = integer_length<MapSize>::value;
-    static const int kLenBits = integer_length<SnakeMaxLen>::value;
+    static const int kIndexBits =
+        integer_length<AnchorCells ? AnchorCells : MapSize>::value;
 
     // Converting between directions and linear coordinate deltas.
     static Coord apply_direction(Direction dir) {
@@ -101,6 +106,69 @@ struct Setup {
     }
 };
 
+// A dense numbering of the empty cells of the map. Those are the
+// only cells that the head of a snake or the first part of a gadget
+// can be in, and on most maps they're well under half of the cells.
+// If Setup::AnchorCells is set, serialized states store positions as
+// indices into this numbering, which need fewer bits than
+// coordinates. Index 0 is coordinate 0, which stands for an object
+// that has left the map.
+//
+// There's one numbering per Setup rather than per Map, since states
+// are serialized without access to the Map. It's set up by the Map
+// constructor.
+template<class Setup>
+class CellIndex {
+public:
+    // Numbers the empty cells of base_map (as stored by Map).
+    static void init(const uint8_t* base_map) {
+        if (!Setup::AnchorCells) {
+            return;
+        }
+        int count = 0;
+        for (Coord i = 0; i < Setup::MapSize; ++i) {
+            index_[i] = 0;
+            if (base_map[i] == ' ' && ++count <= Setup::AnchorCells) {
+                index_[i] = count;
+                coords_[count] = i;
+            }
+        }
+        if (count != Setup::AnchorCells) {
+            fprintf(stderr, "Expected AnchorCells = %d, got %d\n",
+                    count, Setup::AnchorCells);
+            abort();
+        }
+    }
+
+    // Returns the index of the cell at coordinate i, which must be
+    // empty or 0.
+    static uint32_t index(Coord i) {
+        if (!Setup::AnchorCells) {
+            return i;
+        }
+        assert(!i || index_[i]);
+        return index_[i];
+    }
+
+    // Returns the coordinate of the cell with the given index.
+    static Coord coord(uint32_t index) {
+        if (!Setup::AnchorCells) {
+            return index;
+        }
+        assert(index <= Setup::AnchorCells);
+        return coords_[index];
+    }
+
+private:
+    static uint16_t index_[Setup::MapSize];
+    static Coord coords_[Setup::AnchorCells + 1];
+};
+
+template<class Setup>
+uint16_t CellIndex<Setup>::index_[Setup::MapSize];
+template<class Setup>
+Coord CellIndex<Setup>::coords_[Setup::AnchorCells + 1];
+
 // The dynamic representation of a snake.
 //
 // A snake consists of a queue of segments, with each segment
@@ -169,27 +237,40 @@ public:
         return false;
     }
 
-    // Deserializes a snake from bits.
-    template<class P>
-    void unpack(const P* packer, typename P::Context* pc) {
-        packer->extract(tail_, kTailBits, pc);
-        packer->extract(i_[0], Setup::kIndexBits, pc);
-        packer->extract(len_, Setup::kLenBits, pc);
+    // Deserializes a snake from the bits starting at _offset_ (see
+    // Packer::Words). The head is stored above the shape, as the
+    // more significant field, since the sorted runs of full
+    // searches compress better that way than with the shape on top.
+    template<class W>
+    void unpack(W* words, int offset) {
+        uint64_t bits;
+        uint32_t head;
+        words->get(bits, offset, kShapeBits);
+        words->get(head, offset + kShapeBits, Setup::kIndexBits);
+        i_[0] = CellIndex<Setup>::coord(head);
+        if (bits) {
+            int marker = 63 - __builtin_clzll(bits);
+            len_ = marker / Setup::kDirBits + 1;
+            tail_ = bits ^ (UINT64_C(1) << marker);
+        } else {
+            len_ = 0;
+            tail_ = 0;
+        }
         init_locations_from_tail();
     }
 
-    // Serializes this snake to bits.
-    template<class P>
-    void pack(P* packer, typename P::Context* pc) const {
-        packer->deposit(tail_, kTailBits, pc);
-        packer->deposit(i_[0], Setup::kIndexBits, pc);
-        packer->deposit(len_, Setup::kLenBits, pc);
+    // Serializes this snake to the bits starting at _offset_.
+    template<class W>
+    void pack(W* words, int offset) const {
+        words->put(shape(), offset, kShapeBits);
+        words->put(CellIndex<Setup>::index(i_[0]), offset + kShapeBits,
+                   Setup::kIndexBits);
     }
 
     // The amount of bits needed to represent a snake in
     // this Setup.
     static constexpr int packed_width() {
-        return kTailBits + Setup::kIndexBits + Setup::kLenBits;
+        return kShapeBits + Setup::kIndexBits;
     }
 
     // Resets the location of all other segments of the snake to
@@ -219,6 +300,23 @@ public:
     Coord i_[Setup::SnakeMaxLen];
     // The number of segments the snake consists of. Must be at least 2.
     int32_t len_;
+
+private:
+    // The serialized length and tail of the snake: the len_ - 1
+    // directions of tail_, with a marker bit set just above them.
+    // (Or 0 for a snake that has exited). The length is implied by
+    // the position of the marker, so it needs no field of its own,
+    // and the unused high bits of a short tail are always zero.
+    static const int kShapeBits = kTailBits + 1;
+
+    uint64_t shape() const {
+        if (!len_) {
+            return 0;
+        }
+        int marker = (len_ - 1) * Setup::kDirBits;
+        assert(!(tail_ >> marker));
+        return UINT64_C(1) << marker | tail_;
+    }
 };
 
 // A Gadget is a movable object with a fixed shape. The parts
@@ -359,6 +457,8 @@ public:
         assert(snake_count == Setup::SnakeCount);
         assert(teleporter_count == Setup::TeleporterCount);
         assert(exit_);
+
+        CellIndex<Setup>::init(base_map_);
     }
 
     uint32_t trace_tail(const char* base_map, Coord i, int* len) const {
@@ -415,9 +515,9 @@ struct PackedState {
 
     PackedState() {}
     PackedState(const State& st) {
-        typename P::Context pc;
-        st.pack(&p_, &pc);
-        p_.flush(&pc);
+        typename P::Words words;
+        st.pack(&words);
+        p_.store(words);
     }
 
     // The size of the serialized output in bytes.
@@ -430,8 +530,17 @@ struct PackedState {
     uint8_t* bytes() { return p_.bytes_; }
     const uint8_t* bytes() const { return p_.bytes_; }
 
-    // Computes a hashcode for this state.
+    // Computes a hashcode for this state. States of up to 16 bytes
+    // are hashed as two integers, without a call into CityHash.
     uint64_t hash() const {
+        if (kNative) {
+            uint64_t low = load_big_endian_word<kLowBytes>(
+                bytes() + P::Bytes - kLowBytes);
+            uint64_t high = kHighBytes ?
+                load_big_endian_word<kHighBytes ? kHighBytes : 1>(bytes()) :
+                0;
+            return Hash128to64(uint128(low, high));
+        }
         return CityHash64((char*) bytes(),
                           width_bytes());
     }
@@ -443,24 +552,34 @@ struct PackedState {
     }
 
     bool operator<(const PackedState& other) const {
-        // This is morally a memcmp, but it's opencoded since we
-        // don't care about what the ordering is, just that there
-        // is one. (The difference is due to endian issues, which
-        // is why this kind of optimization can't happen automatically).
+        // The same order as memcmp(), i.e. by the fields at the
+        // highest offsets of the Layout first. The sorted runs are
+        // delta coded byte by byte, so this keeps the states that
+        // share their most significant fields next to each other.
         //
-        // return memcmp(bytes(), other.bytes(), P::Bytes) < 0;
+        // States of up to 16 bytes are compared as a single native
+        // integer. Wider ones a word at a time; the words are loaded
+        // with memcpy rather than by casting the byte pointers, since
+        // the latter would break the strict aliasing rules (and does
+        // get miscompiled).
+        if (kNative) {
+            return load_big_endian<kNativeBytes>(bytes()) <
+                load_big_endian<kNativeBytes>(other.bytes());
+        }
         int i = 0;
         for (; i + 7 < P::Bytes; i += 8) {
-            uint64_t a = *((uint64_t*) (bytes() + i));
-            uint64_t b = *((uint64_t*) (other.bytes() + i));
+            uint64_t a, b;
+            memcpy(&a, bytes() + i, sizeof(a));
+            memcpy(&b, other.bytes() + i, sizeof(b));
             if (a != b)
-                return a < b;
+                return __builtin_bswap64(a) < __builtin_bswap64(b);
         }
         for (; i + 3 < P::Bytes; i += 4) {
-            uint32_t a = *((uint32_t*) (bytes() + i));
-            uint32_t b = *((uint32_t*) (other.bytes() + i));
+            uint32_t a, b;
+            memcpy(&a, bytes() + i, sizeof(a));
+            memcpy(&b, other.bytes() + i, sizeof(b));
             if (a != b)
-                return a < b;
+                return __builtin_bswap32(a) < __builtin_bswap32(b);
         }
         for (; i < P::Bytes; ++i) {
             if (at(i) != other.at(i)) {
@@ -470,7 +589,23 @@ struct PackedState {
         return false;
     }
 
+    // Returns the index of the byte that is the i'th most significant
+    // one in the order defined by operator<. This allows for sorting
+    // states with a radix sort.
+    static constexpr int significant_byte(int i) {
+        return i;
+    }
+
     P p_;
+
+private:
+    // Whether the state fits into a native integer (RecordWord).
+    static const bool kNative = P::Bytes <= 16;
+    static const int kNativeBytes = kNative ? P::Bytes : 16;
+    // The number of bytes in the low and high 64 bits of that
+    // integer.
+    static const int kLowBytes = P::Bytes < 8 ? P::Bytes : 8;
+    static const int kHighBytes = kNativeBytes - kLowBytes;
 };
 
 // An index for all the the mutable parts of a State (Fruits,
@@ -582,17 +717,81 @@ private:
     uint8_t obj_map_[Setup::MapSize];
 };
 
-template<class Setup_>
+// The groups of fields of a serialized state.
+enum class Field {
+    kSnakes, kFruit, kGadgets,
+};
+
+// The order of the groups of fields of a serialized state, from the
+// most significant (i.e. the highest bits) to the least significant.
+//
+// The sorted runs of states are delta coded byte by byte, so the
+// fields that change the least from one state to the next should be
+// the most significant ones: sorting then keeps the states that share
+// them together. The fruit mask only changes when a fruit gets eaten,
+// and a gadget only when it's pushed, while almost every move changes
+// a snake. Which of the orders actually compresses best depends on
+// the level, and can be measured with pack-bench.
+template<Field First, Field Second, Field Third>
+struct FieldOrder {
+    static_assert(First != Second && First != Third && Second != Third,
+                  "Each group of fields must be in the order once");
+
+    // The number of groups that are less significant than f.
+    static constexpr int rank(Field f) {
+        return f == Third ? 0 : f == Second ? 1 : 2;
+    }
+};
+
+using DefaultFieldOrder =
+    FieldOrder<Field::kFruit, Field::kGadgets, Field::kSnakes>;
+
+template<class Setup_, class Order = DefaultFieldOrder>
 class State {
     using Setup = Setup_;
     using Snake = typename ::Snake<Setup>;
     using Teleporter = typename std::pair<Coord, Coord>;
 
-    // The size (in bits) of a serialized state object.
+    // The bit offsets of the fields of a serialized state object.
+    // The groups of fields are laid out from the least significant
+    // one of Order up.
+    struct Layout {
+        static constexpr int snake(int si) {
+            return start(Field::kSnakes) + si * Snake::packed_width();
+        }
+        static constexpr int fruit() {
+            return start(Field::kFruit);
+        }
+        static constexpr int gadget(int gi) {
+            return start(Field::kGadgets) + gi * Setup::kIndexBits;
+        }
+        // The size (in bits) of a serialized state object.
+        static constexpr int bits() {
+            return width(Field::kSnakes) + width(Field::kFruit) +
+                width(Field::kGadgets);
+        }
+
+    private:
+        static constexpr int width(Field f) {
+            return f == Field::kSnakes ?
+                Setup::SnakeCount * Snake::packed_width() :
+                f == Field::kFruit ? Setup::FruitCount :
+                Setup::GadgetCount * Setup::kIndexBits;
+        }
+        // The offset of the first field of group f: the total width
+        // of the less significant groups.
+        static constexpr int start(Field f) {
+            return width_if_below(Field::kSnakes, f) +
+                width_if_below(Field::kFruit, f) +
+                width_if_below(Field::kGadgets, f);
+        }
+        static constexpr int width_if_below(Field g, Field f) {
+            return Order::rank(g) < Order::rank(f) ? width(g) : 0;
+        }
+    };
+
     static constexpr int packed_bits() {
-        return Snake::packed_width() * Setup::SnakeCount +
-            Setup::FruitCount +
-            Setup::kIndexBits * Setup::GadgetCount;
+        return Layout::bits();
     }
 
 public:
@@ -622,12 +821,51 @@ public:
         }
     }
 
+    // Copies a state that's serialized in a different field order.
+    template<class OtherOrder>
+    explicit State(const State<Setup, OtherOrder>& other)
+        : fruit_(other.fruit_) {
+        std::copy(&other.snakes_[0], &other.snakes_[Setup::SnakeCount],
+                  &snakes_[0]);
+        std::copy(&other.gadgets_[0], &other.gadgets_[Setup::GadgetCount],
+                  &gadgets_[0]);
+    }
+
     // De-serializes a state from bytes.
     State(const Packed& p) : State() {
-        typename Packed::P::Context pc;
-        unpack(&p.p_, &pc);
+        typename Packed::P::Words words;
+        p.p_.load(&words);
+        unpack(&words);
     };
 
+    // De-serialize the state from the fields of Layout, read from
+    // *words (see Packer::Words).
+    template<class W>
+    void unpack(W* words) {
+        for (int si = 0; si < Setup::SnakeCount; ++si) {
+            snakes_[si].unpack(words, Layout::snake(si));
+        }
+        words->get(fruit_, Layout::fruit(), Setup::FruitCount);
+        for (int gi = 0; gi < Setup::GadgetCount; ++gi) {
+            uint32_t offset;
+            words->get(offset, Layout::gadget(gi), Setup::kIndexBits);
+            gadgets_[gi].offset_ = CellIndex<Setup>::coord(offset);
+        }
+    }
+
+    // Serialize the state into the fields of Layout.
+    template<class W>
+    void pack(W* words) const {
+        for (int si = 0; si < Setup::SnakeCount; ++si) {
+            snakes_[si].pack(words, Layout::snake(si));
+        }
+        words->put(fruit_, Layout::fruit(), Setup::FruitCount);
+        for (int gi = 0; gi < Setup::GadgetCount; ++gi) {
+            words->put(CellIndex<Setup>::index(gadgets_[gi].offset_),
+                       Layout::gadget(gi), Setup::kIndexBits);
+        }
+    }
+
     // Calls fun on states that can be directly reached from this
     // state. Returns true immediately if fun returns true. Otherwise
     // returns false.
@@ -753,6 +991,7 @@ public:
     }
 
 private:
+    template<class, class> friend class State;
     friend Packed;
     friend ObjMap<State>;
     friend ObjMap<State, true>;
@@ -1361,34 +1600,6 @@ private:
         return false;
     }
 
-    // De-serialize the state.
-    template<class P>
-    void unpack(const P* packer, typename P::Context* pc) {
-        for (int si = 0; si < Setup::SnakeCount; ++si) {
-            snakes_[si].unpack(packer, pc);
-        }
-        packer->extract(fruit_, Setup::FruitCount, pc);
-        for (int gi = 0 ; gi < Setup::GadgetCount; ++gi) {
-            packer->extract(gadgets_[gi].offset_,
-                            Setup::kIndexBits,
-                            pc);
-        }
-    }
-
-    // Serialize the state.
-    template<class P>
-    void pack(P* packer, typename P::Context* pc) const {
-        for (int si = 0; si < Setup::SnakeCount; ++si) {
-            snakes_[si].pack(packer, pc);
-        }
-        packer->deposit(fruit_, Setup::FruitCount, pc);
-        for (int gi = 0 ; gi < Setup::GadgetCount; ++gi) {
-            packer->deposit(gadgets_[gi].offset_,
-                            Setup::kIndexBits,
-                            pc);
-        }
-    }
-
     Snake snakes_[Setup::SnakeCount];
     GadgetState gadgets_[Setup::GadgetCount];
     // Bitmask, fruit that are still on the map have the 1 bit set.
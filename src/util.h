@@ -4,9 +4,17 @@
 #define UTIL_H
 
 #include <cassert>
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
 #include <memory>
-#include <queue>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 // Compute the length of an integer (i.e. position of first 1 bit)
 // at compile-time.
@@ -26,6 +34,139 @@ constexpr uint64_t mask_n_bits(uint64_t n) {
     return (UINT64_C(1) << n) - 1;
 }
 
+// The native unsigned integer type that records of up to 16 bytes
+// fit into.
+template<int Bytes>
+using RecordWord = typename std::conditional<Bytes <= 8, uint64_t,
+                                             unsigned __int128>::type;
+
+// Returns the _Bytes_ (at most 8) bytes at p as a little-endian
+// integer. Unlike a memcpy() into a zeroed word, this assembles the
+// word in a register: reading a word back from memory after storing
+// its parts with narrower stores would have to wait for the stores
+// to complete.
+template<int Bytes>
+uint64_t load_word(const uint8_t* p) {
+    static_assert(Bytes > 0 && Bytes <= 8, "A word is at most 8 bytes");
+    if (Bytes == 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        return word;
+    }
+    if (Bytes >= 4) {
+        // Two possibly overlapping 32-bit loads. The overlapping
+        // bytes end up at the same position in both halves.
+        uint32_t low, high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + Bytes - 4, 4);
+        return (uint64_t) high << (8 * (Bytes - 4)) | low;
+    }
+    uint64_t word = 0;
+    for (int i = 0; i < Bytes; ++i) {
+        word |= (uint64_t) p[i] << (8 * i);
+    }
+    return word;
+}
+
+// Like load_word(), but as a big-endian integer, i.e. an integer
+// that orders the same way as memcmp() orders the bytes.
+template<int Bytes>
+uint64_t load_big_endian_word(const uint8_t* p) {
+    return __builtin_bswap64(load_word<Bytes>(p)) >> (8 * (8 - Bytes));
+}
+
+// Like load_big_endian_word(), but for records of up to 16 bytes.
+template<int Bytes>
+RecordWord<Bytes> load_big_endian(const uint8_t* p) {
+    static_assert(Bytes > 0 && Bytes <= 16, "Records are at most 16 bytes");
+    const int low = Bytes > 8 ? 8 : Bytes;
+    RecordWord<Bytes> word = load_big_endian_word<low>(p + Bytes - low);
+    if (Bytes > 8) {
+        const int high = Bytes > 8 ? Bytes - 8 : 1;
+        const int shift = Bytes > 8 ? 64 : 0;
+        word |= (RecordWord<Bytes>) load_big_endian_word<high>(p) << shift;
+    }
+    return word;
+}
+
+// Calls fun(i) once for each i in [0, threads). Each call is made
+// from a separate thread (the first one from the calling thread).
+// Returns once all of the calls have completed.
+template<class Fun>
+void run_parallel(int threads, Fun fun) {
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back(fun, i);
+    }
+    fun(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// A fixed set of worker threads, running tasks from a shared queue
+// in the order they were submitted. Tasks must not wait for tasks
+// that were submitted after them.
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads) {
+        for (int i = 0; i < threads; ++i) {
+            workers_.emplace_back([this] { work(); });
+        }
+    }
+
+    // Runs all the tasks that have already been submitted, and then
+    // stops the workers.
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        cv_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        cv_.notify_one();
+    }
+
+    int size() const {
+        return workers_.size();
+    }
+
+private:
+    ThreadPool(const ThreadPool& other) = delete;
+    ThreadPool& operator=(const ThreadPool& other) = delete;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return done_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> tasks_;
+    bool done_ = false;
+    std::vector<std::thread> workers_;
+};
+
 // Streams:
 //
 // Streams are a lazily computed sequence of records of a given
@@ -41,6 +182,23 @@ constexpr uint64_t mask_n_bits(uint64_t n) {
 // - value() - Returns a reference to the latest decoded record (may not be
 //   called if no records have been read yet). Valid only until next
 //   call to next().
+// - next_batch(T* out, size_t n) - Fetches up to n records into out,
+//   as if by calling next() and copying value() that many times.
+//   Returns the number of records fetched, which is less than n
+//   only if the stream is now empty. Unlike the other operations,
+//   may also be called on an empty stream (and returns 0).
+//
+// The streams that get merged by SortedStreamInterleaver must also
+// have a static less(a, b) function defining the order of their
+// records.
+
+// The number of records of type T to read at once with next_batch()
+// when processing a stream in chunks: a few kilobytes, so that the
+// chunks of many streams fit in the cache at once.
+template<class T>
+constexpr size_t stream_batch_size() {
+    return 4096 / sizeof(T) ? 4096 / sizeof(T) : 1;
+}
 
 // A Stream that treats the memory range "begin" to "end" as
 // an array of T.
@@ -54,11 +212,83 @@ struct PointerStream {
     bool next() { ++begin_; return !empty(); }
     const T& value() const { return *begin_; }
 
+    size_t next_batch(T* out, size_t n) {
+        if (empty()) {
+            return 0;
+        }
+        size_t left = end_ - begin_ - 1;
+        n = std::min(n, left);
+        std::copy(begin_ + 1, begin_ + 1 + n, out);
+        begin_ += n;
+        if (n == left) {
+            begin_ = end_;
+        }
+        return n;
+    }
+
 private:
     const T* begin_;
     const T* end_;
 };
 
+// A prefix policy for SortedStreamInterleaver that doesn't cache
+// anything, so every comparison is done with the full records.
+template<class T>
+struct NoRecordPrefix {
+    static uint64_t get(const T& value) {
+        return 0;
+    }
+};
+
+// A prefix policy for SortedStreamInterleaver on keys that define
+// width_bytes(), bytes() and significant_byte(i): the 8 most
+// significant bytes of the key, as an integer that orders the same
+// way as the keys do.
+template<class Key>
+struct KeyPrefix {
+    static uint64_t get(const Key& key) {
+        if (kWordOrder == kLittleEndian) {
+            uint64_t prefix;
+            memcpy(&prefix, key.bytes(), sizeof(prefix));
+            return prefix;
+        }
+        if (kWordOrder == kBigEndian) {
+            // Keys narrower than 8 bytes fit into the prefix whole.
+            return load_big_endian_word<kWordBytes>(key.bytes()) <<
+                (8 * (8 - kWordBytes));
+        }
+        uint64_t prefix = 0;
+        for (int i = 0; i < 8; ++i) {
+            prefix <<= 8;
+            if (i < Key::width_bytes()) {
+                prefix |= key.bytes()[Key::significant_byte(i)];
+            }
+        }
+        return prefix;
+    }
+
+private:
+    enum WordOrder { kNoWord, kLittleEndian, kBigEndian };
+
+    static const int kWordBytes =
+        Key::width_bytes() < 8 ? Key::width_bytes() : 8;
+
+    // Whether the most significant bytes are the first 8 bytes of
+    // the key (or all of a narrower key) in little-endian or
+    // big-endian order, so that the prefix can be loaded as a single
+    // word.
+    static constexpr WordOrder word_order() {
+        bool little = Key::width_bytes() >= 8, big = true;
+        for (int i = 0; i < kWordBytes; ++i) {
+            little = little && Key::significant_byte(i) == 7 - i;
+            big = big && Key::significant_byte(i) == i;
+        }
+        return little ? kLittleEndian : big ? kBigEndian : kNoWord;
+    }
+
+    static const WordOrder kWordOrder = word_order();
+};
+
 // A Stream that merges together multiple streams. value()
 // and next() will only operate on the stream whose head value
 // is the smallest. The unstated assumption is that the
@@ -70,28 +300,41 @@ private:
 //   a = value(); next(); b = value();
 //   assert(a != b);
 //
-// This is internally implemented using a heap-based priority
-// queue.
-template<class T, class Stream, bool DeleteDuplicates=true>
+// This is internally implemented as a tournament tree of losers:
+// each internal node holds the stream that lost the comparison at
+// that node, so replacing the head of the winning stream takes just
+// one comparison per level of the tree. The records are compared with
+// Stream::less, but first by Prefix::get(), which must be consistent
+// with that order. The prefixes are cached, so most comparisons
+// don't need to look at the full records.
+//
+// The records of each stream are read in batches of
+// stream_batch_size<T>() records.
+template<class T, class Stream, bool DeleteDuplicates=true,
+         class Prefix=NoRecordPrefix<T>>
 struct SortedStreamInterleaver {
     SortedStreamInterleaver() {
     }
 
     ~SortedStreamInterleaver() {
-        while (!streams_.empty()) {
-            delete streams_.top();
-            streams_.pop();
+        for (auto& input : inputs_) {
+            delete input.stream;
         }
     }
 
     // Registers "stream" as one of the component streams that
-    // will be merged together. Takes ownership of the stream.
+    // will be merged together. Takes ownership of the stream. All
+    // streams must be added before the first call to next().
     void add_stream(Stream* stream) {
-        if (stream->next()) {
-            streams_.push(stream);
+        assert(!started_);
+        inputs_.emplace_back();
+        Input& input = inputs_.back();
+        input.stream = stream;
+        input.records.resize(stream_batch_size<T>());
+        if (refill(&input)) {
             empty_ = false;
         } else {
-            delete stream;
+            inputs_.pop_back();
         }
     }
 
@@ -100,48 +343,140 @@ struct SortedStreamInterleaver {
     }
 
     bool next() {
-        if (streams_.empty()) {
-            empty_ = true;
+        if (!started_) {
+            started_ = true;
+            if (inputs_.empty()) {
+                empty_ = true;
+                return false;
+            }
+            tree_.resize(inputs_.size());
+            tree_[0] = build(1);
+            return true;
+        }
+        if (empty_) {
             return false;
         }
 
-        // God, the priority_queue interface is hard to use.
-        auto top_stream = streams_.top();
-        T value = top_stream->value();
-        streams_.pop();
-        if (top_stream->next()) {
-            streams_.push(top_stream);
+        if (DeleteDuplicates) {
+            // Skip all the other records equal to the current
+            // one. They're the next winners, if they exist.
+            T top = value();
+            do {
+                advance();
+            } while (!empty_ && value() == top);
         } else {
-            delete top_stream;
+            advance();
         }
+        return !empty_;
+    }
 
-        if (DeleteDuplicates) {
-            if (value == top_) {
-                return next();
-            }
+    const T& value() const {
+        return head(tree_[0].stream);
+    }
+
+    size_t next_batch(T* out, size_t n) {
+        size_t count = 0;
+        while (count < n && !empty_ && next()) {
+            out[count++] = value();
         }
+        return count;
+    }
+
+private:
+    // A stream, and the batch of records that has been read from it.
+    struct Input {
+        // NULL once the stream has been exhausted.
+        Stream* stream = NULL;
+        std::vector<T> records;
+        // The current record, and the number of records in the
+        // batch.
+        size_t pos = 0;
+        size_t size = 0;
+    };
+
+    // A stream in the tree, along with the prefix of its current
+    // record.
+    struct Node {
+        uint64_t prefix;
+        int stream;
+    };
+
+    const T& head(int i) const {
+        const Input& input = inputs_[i];
+        return input.records[input.pos];
+    }
 
-        top_ = value;
+    // Reads the next batch of records of the input. If there are
+    // none, deletes the stream and returns false.
+    bool refill(Input* input) {
+        input->pos = 0;
+        input->size = input->stream->next_batch(input->records.data(),
+                                                input->records.size());
+        if (!input->size) {
+            delete input->stream;
+            input->stream = NULL;
+            return false;
+        }
         return true;
     }
 
-    const T& value() const {
-        return top_;
+    // Returns the winner of the subtree rooted at node, storing the
+    // losers in the internal nodes. The leaves are nodes k to 2k - 1,
+    // for k streams.
+    Node build(int node) {
+        int k = inputs_.size();
+        if (node >= k) {
+            return Node { Prefix::get(head(node - k)), node - k };
+        }
+        Node left = build(2 * node);
+        Node right = build(2 * node + 1);
+        if (less(right, left)) {
+            std::swap(left, right);
+        }
+        tree_[node] = right;
+        return left;
     }
 
-private:
-    T top_;
-    bool empty_ = false;
+    // Moves the winning stream to its next record, and replays its
+    // path to the root.
+    void advance() {
+        Node winner = tree_[0];
+        Input& input = inputs_[winner.stream];
+        if (++input.pos < input.size || refill(&input)) {
+            winner.prefix = Prefix::get(head(winner.stream));
+        } else {
+            winner.prefix = ~UINT64_C(0);
+        }
+        for (int node = (winner.stream + inputs_.size()) / 2; node;
+             node /= 2) {
+            if (less(tree_[node], winner)) {
+                std::swap(tree_[node], winner);
+            }
+        }
+        tree_[0] = winner;
+        empty_ = inputs_[winner.stream].stream == NULL;
+    }
 
-    struct Cmp {
-        bool operator()(const Stream* a, const Stream* b) {
-            // Note: invert the comparison since priority_queue
-            // is by default a max-heap rather than a min-heap.
-            return *b < *a;
+    // Whether the current record of stream a is smaller than that of
+    // stream b. Exhausted streams are larger than all others.
+    bool less(const Node& a, const Node& b) const {
+        if (a.prefix != b.prefix) {
+            return a.prefix < b.prefix;
         }
-    };
+        bool done_a = inputs_[a.stream].stream == NULL;
+        bool done_b = inputs_[b.stream].stream == NULL;
+        if (done_a || done_b) {
+            return !done_a && done_b;
+        }
+        return Stream::less(head(a.stream), head(b.stream));
+    }
 
-    std::priority_queue<Stream*, std::vector<Stream*>, Cmp> streams_;
+    bool started_ = false;
+    bool empty_ = false;
+    std::vector<Input> inputs_;
+    // The winner, followed by the losers at the internal nodes of the
+    // tree.
+    std::vector<Node> tree_;
 };
 
 // A stream that takes two input streams of type K and V, and produces
@@ -198,13 +533,48 @@ struct StreamPairer {
         return pair_;
     }
 
-    bool operator<(const StreamPairer& other) const {
-        return *keys_ < *other.keys_;
+    // Reads a batch of keys and a batch of values from the input
+    // streams, and pairs them up.
+    size_t next_batch(Pair* out, size_t n) {
+        if (empty_) {
+            return 0;
+        }
+        if (key_batch_.size() < n) {
+            key_batch_.resize(n);
+            value_batch_.resize(n);
+        }
+        size_t count = keys_->next_batch(key_batch_.data(), n);
+        count = values_->next_batch(value_batch_.data(), count);
+        for (size_t i = 0; i < count; ++i) {
+            out[i].first = key_batch_[i];
+            out[i].second = value_batch_[i];
+        }
+        if (count < n) {
+            empty_ = true;
+        }
+        if (count) {
+            pair_ = out[count - 1];
+        }
+        return count;
+    }
+
+    // Orders pairs by their key. Pairs with identical keys are
+    // ordered by their value, so that merging streams with duplicate
+    // keys will always produce the pair with the smallest value
+    // first.
+    static bool less(const Pair& a, const Pair& b) {
+        if (a.first == b.first) {
+            return a.second < b.second;
+        }
+        return a.first < b.first;
     }
 
 private:
     bool empty_ = false;
     Pair pair_;
+    // The batches read from keys_ and values_ by next_batch().
+    std::vector<K> key_batch_;
+    std::vector<V> value_batch_;
     std::unique_ptr<KeyStream> keys_;
     std::unique_ptr<ValueStream> values_;
 };